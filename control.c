@@ -1,15 +1,18 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/async.h>
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/xarray.h>
 
 #include "control.h"
 #include "device.h"
 #include "fb.h"
+#include "pool.h"
 #include "videobuf.h"
 
 extern unsigned short devices_max;
@@ -20,13 +23,38 @@ struct control_device {
     struct class *dev_class;
     struct device *device;
     struct cdev cdev;
-    struct vcam_device **vcam_devices;
+    /* Devices by index. The index of a device never changes, and lookups
+     * run under RCU; updates take the xarray lock.
+     */
+    struct xarray vcam_devices;
     size_t vcam_device_count;
-    spinlock_t vcam_devices_lock;
 };
 
 static struct control_device *ctldev = NULL;
 
+static void vcam_device_release(struct kref *ref)
+{
+    destroy_vcam_device(container_of(ref, struct vcam_device, refcount));
+}
+
+/* Look a device up by index and take a reference on it */
+static struct vcam_device *vcam_device_get(unsigned int idx)
+{
+    struct vcam_device *dev;
+
+    rcu_read_lock();
+    dev = xa_load(&ctldev->vcam_devices, idx);
+    if (dev && !kref_get_unless_zero(&dev->refcount))
+        dev = NULL;
+    rcu_read_unlock();
+    return dev;
+}
+
+static void vcam_device_put(struct vcam_device *dev)
+{
+    kref_put(&dev->refcount, vcam_device_release);
+}
+
 static int control_open(struct inode *inode, struct file *file)
 {
     return 0;
@@ -42,9 +70,19 @@ static ssize_t control_read(struct file *file,
                             size_t length,
                             loff_t *offset)
 {
-    static const char *str = "Virtual V4L2 compatible camera device\n";
+    struct vcam_pool_stats stats;
+    char str[192];
+    int len;
+
     pr_debug("read %p %dB\n", buffer, (int) length);
-    return simple_read_from_buffer(buffer, length, offset, str, strlen(str));
+    /* Frame memory use, so allocation failures can be told apart */
+    vcam_pool_get_stats(&stats);
+    len = scnprintf(str, sizeof(str),
+                    "Virtual V4L2 compatible camera device\n"
+                    "frame memory: %zu used, %zu cached, %zu budget\n"
+                    "allocation failures: %llu\n",
+                    stats.used, stats.cached, stats.budget, stats.failures);
+    return simple_read_from_buffer(buffer, length, offset, str, len);
 }
 
 static ssize_t control_write(struct file *file,
@@ -56,84 +94,294 @@ static ssize_t control_write(struct file *file,
     return length;
 }
 
+static void fill_device_spec(struct vcam_device *dev,
+                             struct vcam_device_spec *dev_spec)
+{
+    size_t len;
+    int i;
+
+    dev_spec->width = dev->config.spec.xres_virtual;
+    dev_spec->height = dev->config.spec.yres_virtual;
+    dev_spec->pix_fmt = dev->config.spec.pix_fmt;
+    dev_spec->mem_type = dev->config.spec.mem_type;
+    dev_spec->cropratio = dev->config.spec.cropratio;
+
+    strncpy((char *) &dev_spec->fb_node, (const char *) vcamfb_get_devnode(dev),
+            sizeof(dev_spec->fb_node));
+    for (i = 0, len = 0; i < dev->nr_outputs; i++) {
+        len += snprintf(dev_spec->video_node + len,
+                        sizeof(dev_spec->video_node) - len, "%s/dev/video%d",
+                        i ? "," : "", dev->outputs[i].vdev.num);
+        if (len >= sizeof(dev_spec->video_node))
+            break;
+    }
+}
+
+static void fill_device_config(struct vcam_device *dev,
+                               struct vcam_device_config *config)
+{
+    fill_device_spec(dev, &config->spec);
+    config->nr_outputs = dev->nr_outputs;
+    config->numa_node = dev->numa_node + 1;
+    memcpy(config->cpus, dev->config.cpus, sizeof(config->cpus));
+    config->sched_policy = dev->config.sched_policy;
+    config->sched_priority = dev->config.sched_priority;
+    config->sched_runtime_us = dev->config.sched_runtime_us;
+}
+
 static int control_iocontrol_get_device(struct vcam_device_spec *dev_spec)
 {
-    struct vcam_device *dev;
+    struct vcam_device *dev = vcam_device_get(dev_spec->idx);
 
-    if (ctldev->vcam_device_count <= dev_spec->idx)
+    if (!dev)
         return -EINVAL;
 
-    dev = ctldev->vcam_devices[dev_spec->idx];
-    dev_spec->width = dev->fb_spec.xres_virtual;
-    dev_spec->height = dev->fb_spec.yres_virtual;
-    dev_spec->pix_fmt = dev->fb_spec.pix_fmt;
-    dev_spec->mem_type = dev->fb_spec.mem_type;
-    dev_spec->cropratio = dev->fb_spec.cropratio;
+    fill_device_spec(dev, dev_spec);
+    vcam_device_put(dev);
+    return 0;
+}
 
-    strncpy((char *) &dev_spec->fb_node, (const char *) vcamfb_get_devnode(dev),
-            sizeof(dev_spec->fb_node));
-    snprintf((char *) &dev_spec->video_node, sizeof(dev_spec->video_node),
-             "/dev/video%d", dev->vdev.num);
+static int control_iocontrol_get_config(struct vcam_device_config *config)
+{
+    struct vcam_device *dev = vcam_device_get(config->spec.idx);
+
+    if (!dev)
+        return -EINVAL;
+
+    fill_device_config(dev, config);
+    vcam_device_put(dev);
     return 0;
 }
 
-static int control_iocontrol_modify_input_setting(
-    struct vcam_device_spec *dev_spec)
+static void fill_device_state(struct vcam_device *dev,
+                              struct vcam_device_state *state)
 {
+    int i;
+
+    fill_device_config(dev, &state->config);
+    state->fb_open = dev->fb_isopen;
+    state->input_frames = dev->in_queue.sequence;
+    for (i = 0; i < dev->nr_outputs; i++) {
+        struct vcam_output *out = &dev->outputs[i];
+        struct vcam_output_state *os = &state->outputs[i];
+
+        os->streaming = vb2_is_streaming(&out->vb_out_vidq);
+        os->sequence = out->sequence;
+        os->skipped = out->skipped;
+        os->dropped = out->overload.dropped;
+        os->overruns = out->overload.overruns;
+        os->fps = out->fps_achieved;
+    }
+}
+
+/* Report every device in a single call, for agents polling them */
+static int control_iocontrol_enum_devices(void __user *arg)
+{
+    struct vcam_device_enum devenum;
+    struct vcam_device_state *states;
     struct vcam_device *dev;
+    unsigned long idx;
+    size_t n, max;
+    int ret = 0;
+
+    if (copy_from_user(&devenum, arg, sizeof(devenum)))
+        return -EFAULT;
+    if (devenum.state_size != sizeof(*states))
+        return -EINVAL;
+
+    max = min_t(size_t, devenum.count, devices_max);
+    states = kvcalloc(max ? max : 1, sizeof(*states), GFP_KERNEL);
+    if (!states)
+        return -ENOMEM;
+
+    /* Devices removed meanwhile stay allocated until rcu_read_unlock() */
+    n = 0;
+    devenum.total = 0;
+    rcu_read_lock();
+    xa_for_each(&ctldev->vcam_devices, idx, dev) {
+        devenum.total++;
+        if (n == max)
+            continue;
+        states[n].config.spec.idx = idx;
+        fill_device_state(dev, &states[n++]);
+    }
+    rcu_read_unlock();
+
+    devenum.count = n;
+    if (copy_to_user(u64_to_user_ptr(devenum.devices), states,
+                     n * sizeof(*states)) ||
+        copy_to_user(arg, &devenum, sizeof(devenum)))
+        ret = -EFAULT;
+
+    kvfree(states);
+    return ret;
+}
+
+/* Reconfigure a device with @config, or only with its spec keeping the
+ * other settings of the device when @spec_only.
+ */
+static int control_iocontrol_modify_input_setting(
+    struct vcam_device_config *config,
+    bool spec_only)
+{
+    struct vcam_device *dev = vcam_device_get(config->spec.idx);
     int res;
 
-    if (ctldev->vcam_device_count <= dev_spec->idx)
+    if (!dev)
         return -EINVAL;
 
-    dev = ctldev->vcam_devices[dev_spec->idx];
+    if (spec_only) {
+        struct vcam_device_spec dev_spec = config->spec;
 
-    res = modify_vcam_device(dev, dev_spec);
+        fill_device_config(dev, config);
+        config->spec = dev_spec;
+    }
+    res = modify_vcam_device(dev, config);
+    vcam_device_put(dev);
 
     return res;
 }
 
 static int control_iocontrol_destroy_device(struct vcam_device_spec *dev_spec)
 {
-    struct vcam_device *dev;
-    unsigned long ctldev_flags = 0;
+    struct vcam_device *dev = vcam_device_get(dev_spec->idx);
     unsigned long dev_flags = 0;
     int i;
 
-    spin_lock_irqsave(&ctldev->vcam_devices_lock, ctldev_flags);
-    if (ctldev->vcam_device_count <= dev_spec->idx) {
-        spin_unlock_irqrestore(&ctldev->vcam_devices_lock, ctldev_flags);
+    if (!dev)
         return -EINVAL;
-    }
-
-    dev = ctldev->vcam_devices[dev_spec->idx];
 
     spin_lock_irqsave(&dev->in_fh_slock, dev_flags);
-    if (dev->fb_isopen || vb2_is_busy(&dev->vb_out_vidq)) {
+    for (i = 0; i < dev->nr_outputs; i++) {
+        if (vb2_is_busy(&dev->outputs[i].vb_out_vidq))
+            break;
+    }
+    if (dev->fb_claimed || i < dev->nr_outputs) {
         spin_unlock_irqrestore(&dev->in_fh_slock, dev_flags);
-        spin_unlock_irqrestore(&ctldev->vcam_devices_lock, ctldev_flags);
+        vcam_device_put(dev);
         return -EBUSY;
     }
-    dev->fb_isopen = true;
+    dev->fb_claimed = true;
     spin_unlock_irqrestore(&dev->in_fh_slock, dev_flags);
 
-    for (i = dev_spec->idx; i + 1 < (ctldev->vcam_device_count); i++)
-        ctldev->vcam_devices[i] = ctldev->vcam_devices[i + 1];
-    ctldev->vcam_devices[--ctldev->vcam_device_count] = NULL;
-    spin_unlock_irqrestore(&ctldev->vcam_devices_lock, ctldev_flags);
+    xa_lock(&ctldev->vcam_devices);
+    __xa_erase(&ctldev->vcam_devices, dev_spec->idx);
+    ctldev->vcam_device_count--;
+    xa_unlock(&ctldev->vcam_devices);
 
-    destroy_vcam_device(dev);
+    /* Wait for lookups that found the device before taking the last
+     * references: the one from the lookup above and the registry's.
+     */
+    synchronize_rcu();
+    vcam_device_put(dev);
+    vcam_device_put(dev);
 
     return 0;
 }
 
+static int control_iocontrol_create_devices(void __user *arg)
+{
+    struct vcam_device_create create;
+    struct vcam_device_config *specs;
+    int *results;
+    int ret = 0;
+    u32 i;
+
+    if (copy_from_user(&create, arg, sizeof(create)))
+        return -EFAULT;
+    if (!create.count || create.count > devices_max ||
+        create.spec_size != sizeof(*specs))
+        return -EINVAL;
+
+    specs = kcalloc(create.count, sizeof(*specs), GFP_KERNEL);
+    results = kcalloc(create.count, sizeof(*results), GFP_KERNEL);
+    if (!specs || !results) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(specs, u64_to_user_ptr(create.specs),
+                       create.count * sizeof(*specs))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    ret = request_vcam_devices(specs, create.count, results);
+    if (ret)
+        goto out;
+
+    for (i = 0, create.created = 0; i < create.count; i++)
+        if (!results[i])
+            create.created++;
+    if (copy_to_user(u64_to_user_ptr(create.specs), specs,
+                     create.count * sizeof(*specs)) ||
+        copy_to_user(u64_to_user_ptr(create.results), results,
+                     create.count * sizeof(*results)) ||
+        copy_to_user(arg, &create, sizeof(create)))
+        ret = -EFAULT;
+
+out:
+    kfree(results);
+    kfree(specs);
+    return ret;
+}
+
+static long control_ioctl_config(unsigned int iocontrol_cmd,
+                                 void __user *arg)
+{
+    struct vcam_device_config config;
+    int ret;
+
+    if (copy_from_user(&config, arg, sizeof(config)))
+        return -EFAULT;
+
+    switch (iocontrol_cmd) {
+    case VCAM_IOCTL_CREATE_CONFIG:
+        pr_debug("Requesting new device\n");
+        ret = request_vcam_device(&config);
+        break;
+    case VCAM_IOCTL_GET_CONFIG:
+        pr_debug("Get device(%d)\n", config.spec.idx);
+        ret = control_iocontrol_get_config(&config);
+        break;
+    default:
+        pr_debug("Modify setting(%d)\n", config.spec.idx);
+        ret = control_iocontrol_modify_input_setting(&config, false);
+        break;
+    }
+
+    if (!ret && copy_to_user(arg, &config, sizeof(config)))
+        ret = -EFAULT;
+    return ret;
+}
+
 static long control_ioctl(struct file *file,
                           unsigned int iocontrol_cmd,
                           unsigned long iocontrol_param)
 {
+    struct vcam_device_config config = {};
     struct vcam_device_spec dev_spec;
-    long ret = copy_from_user(&dev_spec, (void __user *) iocontrol_param,
-                              sizeof(struct vcam_device_spec));
+    long ret;
+
+    /* Takes a struct vcam_device_enum rather than a device spec */
+    if (iocontrol_cmd == VCAM_IOCTL_ENUM_DEVICES) {
+        pr_debug("Enumerate devices\n");
+        return control_iocontrol_enum_devices((void __user *) iocontrol_param);
+    }
+    if (iocontrol_cmd == VCAM_IOCTL_CREATE_DEVICES) {
+        pr_debug("Requesting new devices\n");
+        return control_iocontrol_create_devices(
+            (void __user *) iocontrol_param);
+    }
+    if (iocontrol_cmd == VCAM_IOCTL_CREATE_CONFIG ||
+        iocontrol_cmd == VCAM_IOCTL_GET_CONFIG ||
+        iocontrol_cmd == VCAM_IOCTL_MODIFY_CONFIG)
+        return control_ioctl_config(iocontrol_cmd,
+                                    (void __user *) iocontrol_param);
+
+    /* The spec ioctls keep the layout of the first release */
+
+    ret = copy_from_user(&dev_spec, (void __user *) iocontrol_param,
+                         sizeof(struct vcam_device_spec));
     if (ret != 0) {
         pr_warn("Failed to copy_from_user!");
         return -1;
@@ -141,7 +389,8 @@ static long control_ioctl(struct file *file,
     switch (iocontrol_cmd) {
     case VCAM_IOCTL_CREATE_DEVICE:
         pr_debug("Requesting new device\n");
-        ret = request_vcam_device(&dev_spec);
+        config.spec = dev_spec;
+        ret = request_vcam_device(&config);
         break;
     case VCAM_IOCTL_DESTROY_DEVICE:
         pr_debug("Requesting removal of device\n");
@@ -160,7 +409,8 @@ static long control_ioctl(struct file *file,
         break;
     case VCAM_IOCTL_MODIFY_SETTING:
         pr_debug("Modify setting(%d)\n", dev_spec.idx);
-        ret = control_iocontrol_modify_input_setting(&dev_spec);
+        config.spec = dev_spec;
+        ret = control_iocontrol_modify_input_setting(&config, true);
         break;
     default:
         ret = -1;
@@ -168,39 +418,97 @@ static long control_ioctl(struct file *file,
     return ret;
 }
 
-static struct vcam_device_spec default_vcam_spec = {
-    .width = 640,
-    .height = 480,
-    .cropratio = {.numerator = 3, .denominator = 4},
-    .pix_fmt = VCAM_PIXFMT_RGB24,
-    .mem_type = VCAM_MEMORY_MMAP,
+static struct vcam_device_config default_vcam_config = {
+    .spec =
+        {
+            .width = 640,
+            .height = 480,
+            .cropratio = {.numerator = 3, .denominator = 4},
+            .pix_fmt = VCAM_PIXFMT_RGB24,
+            .mem_type = VCAM_MEMORY_MMAP,
+        },
 };
 
-int request_vcam_device(struct vcam_device_spec *dev_spec)
+int request_vcam_device(struct vcam_device_config *config)
 {
+    int result;
+    int ret = request_vcam_devices(config, 1, &result);
+
+    return ret ? ret : result;
+}
+
+struct vcam_create_work {
+    struct vcam_device_config config;
+    u32 idx;
     struct vcam_device *vcam;
-    int idx;
-    unsigned long flags = 0;
+    int result;
+};
 
-    if (!ctldev)
-        return -ENODEV;
+static ASYNC_DOMAIN_EXCLUSIVE(vcam_create_domain);
 
-    if (ctldev->vcam_device_count > devices_max)
-        return -ENOMEM;
+static void vcam_create_async(void *data, async_cookie_t cookie)
+{
+    struct vcam_create_work *work = data;
 
-    if (!dev_spec)
-        vcam =
-            create_vcam_device(ctldev->vcam_device_count, &default_vcam_spec);
-    else
-        vcam = create_vcam_device(ctldev->vcam_device_count, dev_spec);
+    work->vcam = create_vcam_device(work->idx, &work->config);
+}
+
+/* Registering a device, its video nodes and its framebuffer is slow, so the
+ * devices are initialized in parallel. Their indices are reserved first, and
+ * those created are published in the registry together once all of them are
+ * initialized. Their nodes are registered, and visible, before that.
+ */
+int request_vcam_devices(struct vcam_device_config *configs,
+                         size_t count,
+                         int *results)
+{
+    struct xarray *xa;
+    struct vcam_create_work *works;
+    size_t i;
 
-    if (!vcam)
+    if (!ctldev)
         return -ENODEV;
 
-    spin_lock_irqsave(&ctldev->vcam_devices_lock, flags);
-    idx = ctldev->vcam_device_count++;
-    ctldev->vcam_devices[idx] = vcam;
-    spin_unlock_irqrestore(&ctldev->vcam_devices_lock, flags);
+    works = kvcalloc(count, sizeof(*works), GFP_KERNEL);
+    if (!works)
+        return -ENOMEM;
+
+    xa = &ctldev->vcam_devices;
+    for (i = 0; i < count; i++) {
+        works[i].config = configs ? configs[i] : default_vcam_config;
+        if (xa_alloc(xa, &works[i].idx, NULL, XA_LIMIT(0, devices_max - 1),
+                     GFP_KERNEL)) {
+            works[i].result = -ENOMEM;
+            continue;
+        }
+        async_schedule_domain(vcam_create_async, &works[i],
+                              &vcam_create_domain);
+    }
+    async_synchronize_full_domain(&vcam_create_domain);
+
+    xa_lock(xa);
+    for (i = 0; i < count; i++) {
+        if (works[i].result)
+            continue;
+        if (!works[i].vcam) {
+            __xa_erase(xa, works[i].idx);
+            works[i].result = -ENODEV;
+            continue;
+        }
+        /* The index is reserved, so storing into it does not allocate */
+        __xa_store(xa, works[i].idx, works[i].vcam, GFP_ATOMIC);
+        ctldev->vcam_device_count++;
+        works[i].config.spec.idx = works[i].idx;
+    }
+    xa_unlock(xa);
+
+    if (results)
+        for (i = 0; i < count; i++)
+            results[i] = works[i].result;
+    if (configs)
+        for (i = 0; i < count; i++)
+            configs[i] = works[i].config;
+    kvfree(works);
     return 0;
 }
 
@@ -209,30 +517,22 @@ static struct control_device *alloc_control_device(void)
     struct control_device *res =
         (struct control_device *) kmalloc(sizeof(*res), GFP_KERNEL);
     if (!res)
-        goto return_res;
+        return NULL;
 
-    res->vcam_devices = (struct vcam_device **) kmalloc(
-        sizeof(struct vcam_device *) * devices_max, GFP_KERNEL);
-    if (!(res->vcam_devices))
-        goto vcam_alloc_failure;
-    memset(res->vcam_devices, 0x00, sizeof(struct vcam_device *) * devices_max);
+    xa_init_flags(&res->vcam_devices, XA_FLAGS_ALLOC);
     res->vcam_device_count = 0;
 
     return res;
-
-vcam_alloc_failure:
-    kfree(res);
-    res = NULL;
-return_res:
-    return res;
 }
 
 static void free_control_device(struct control_device *dev)
 {
-    size_t i;
-    for (i = 0; i < dev->vcam_device_count; i++)
-        destroy_vcam_device(dev->vcam_devices[i]);
-    kfree(dev->vcam_devices);
+    struct vcam_device *vcam;
+    unsigned long idx;
+
+    xa_for_each(&dev->vcam_devices, idx, vcam)
+        vcam_device_put(vcam);
+    xa_destroy(&dev->vcam_devices);
     device_destroy(dev->dev_class, dev->dev_number);
     class_destroy(dev->dev_class);
     cdev_del(&dev->cdev);
@@ -295,8 +595,6 @@ int __init create_control_device(const char *dev_name)
         goto device_create_failure;
     }
 
-    spin_lock_init(&ctldev->vcam_devices_lock);
-
     return 0;
 device_create_failure:
     cdev_del(&ctldev->cdev);
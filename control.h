@@ -7,6 +7,10 @@ int create_control_device(const char *dev_name);
 void destroy_control_device(void);
 
 /* request new virtual camera device */
-int request_vcam_device(struct vcam_device_spec *dev_spec);
+int request_vcam_device(struct vcam_device_config *config);
+/* request count new devices at once, configs may be NULL for the defaults */
+int request_vcam_devices(struct vcam_device_config *configs,
+                         size_t count,
+                         int *results);
 
 #endif
@@ -1,20 +1,36 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/debugfs.h>
+#include <linux/dma-mapping.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/types.h>
+#include <linux/seq_file.h>
 #include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/topology.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <media/v4l2-event.h>
 #include <media/v4l2-image-sizes.h>
 #include <media/videobuf2-core.h>
 #include <media/videobuf2-vmalloc.h>
 
 #include "device.h"
 #include "fb.h"
+#include "jpeg.h"
+#include "pool.h"
 #include "videobuf.h"
 
 extern const char *vcam_dev_name;
 extern unsigned char allow_pix_conversion;
 extern unsigned char allow_scaling;
 extern unsigned char allow_cropping;
+extern unsigned char allow_zero_copy;
+extern unsigned char compare_writes;
+extern unsigned char allow_vfr;
+extern unsigned int preconvert_lead_us;
+extern unsigned int idle_release_ms;
+extern struct dentry *vcam_debugfs_root;
 
 struct __attribute__((__packed__)) rgb_struct {
     unsigned char r, g, b;
@@ -31,6 +47,61 @@ static const struct vcam_device_format vcam_supported_fmts[] = {
         .fourcc = V4L2_PIX_FMT_YUYV,
         .bit_depth = 16,
     },
+    {
+        .name = "Motion-JPEG",
+        .fourcc = V4L2_PIX_FMT_MJPEG,
+        .bit_depth = 16,
+    },
+    {
+        .name = "10-bit Greyscale",
+        .fourcc = V4L2_PIX_FMT_Y10,
+        .bit_depth = 16,
+    },
+    {
+        .name = "10-bit Y/CbCr 4:2:0 (P010)",
+        .fourcc = V4L2_PIX_FMT_P010,
+        .bit_depth = 24,
+    },
+    {
+        .name = "8-bit Bayer RGRG/GBGB",
+        .fourcc = V4L2_PIX_FMT_SRGGB8,
+        .bit_depth = 8,
+    },
+    {
+        .name = "8-bit Bayer GRGR/BGBG",
+        .fourcc = V4L2_PIX_FMT_SGRBG8,
+        .bit_depth = 8,
+    },
+    {
+        .name = "8-bit Bayer GBGB/RGRG",
+        .fourcc = V4L2_PIX_FMT_SGBRG8,
+        .bit_depth = 8,
+    },
+    {
+        .name = "8-bit Bayer BGBG/GRGR",
+        .fourcc = V4L2_PIX_FMT_SBGGR8,
+        .bit_depth = 8,
+    },
+    {
+        .name = "10-bit Bayer RGRG/GBGB",
+        .fourcc = V4L2_PIX_FMT_SRGGB10,
+        .bit_depth = 16,
+    },
+    {
+        .name = "10-bit Bayer GRGR/BGBG",
+        .fourcc = V4L2_PIX_FMT_SGRBG10,
+        .bit_depth = 16,
+    },
+    {
+        .name = "10-bit Bayer GBGB/RGRG",
+        .fourcc = V4L2_PIX_FMT_SGBRG10,
+        .bit_depth = 16,
+    },
+    {
+        .name = "10-bit Bayer BGBG/GRGR",
+        .fourcc = V4L2_PIX_FMT_SBGGR10,
+        .bit_depth = 16,
+    },
 };
 
 static const struct v4l2_file_operations vcam_fops = {
@@ -91,7 +162,8 @@ static int vcam_enum_fmt_vid_cap(struct file *file,
                                  struct v4l2_fmtdesc *f)
 {
     struct vcam_device_format *fmt;
-    struct vcam_device *dev = (struct vcam_device *) video_drvdata(file);
+    struct vcam_output *out = video_drvdata(file);
+    struct vcam_device *dev = out->dev;
     int idx = f->index;
 
     if (idx >= dev->nr_fmts)
@@ -107,8 +179,13 @@ static int vcam_g_fmt_vid_cap(struct file *file,
                               void *priv,
                               struct v4l2_format *f)
 {
-    struct vcam_device *dev = (struct vcam_device *) video_drvdata(file);
-    memcpy(&f->fmt.pix, &dev->output_format, sizeof(struct v4l2_pix_format));
+    struct vcam_output *out = video_drvdata(file);
+
+    if (out->source_changed && !vb2_is_busy(&out->vb_out_vidq)) {
+        out->output_format = out->dev->input_format;
+        out->source_changed = false;
+    }
+    memcpy(&f->fmt.pix, &out->output_format, sizeof(struct v4l2_pix_format));
     return 0;
 }
 
@@ -123,6 +200,98 @@ static bool check_supported_pixfmt(struct vcam_device *dev, unsigned int fourcc)
     return (i == dev->nr_fmts) ? false : true;
 }
 
+/* Colour channel (0: R, 1: G, 2: B) of each pixel in the top-left 2x2 cell
+ * of the colour filter array, in row-major order. Returns NULL for formats
+ * that are not Bayer.
+ */
+static const unsigned char *bayer_cfa_order(__u32 fourcc)
+{
+    static const unsigned char rggb[] = {0, 1, 1, 2};
+    static const unsigned char grbg[] = {1, 0, 2, 1};
+    static const unsigned char gbrg[] = {1, 2, 0, 1};
+    static const unsigned char bggr[] = {2, 1, 1, 0};
+
+    switch (fourcc) {
+    case V4L2_PIX_FMT_SRGGB8:
+    case V4L2_PIX_FMT_SRGGB10:
+        return rggb;
+    case V4L2_PIX_FMT_SGRBG8:
+    case V4L2_PIX_FMT_SGRBG10:
+        return grbg;
+    case V4L2_PIX_FMT_SGBRG8:
+    case V4L2_PIX_FMT_SGBRG10:
+        return gbrg;
+    case V4L2_PIX_FMT_SBGGR8:
+    case V4L2_PIX_FMT_SBGGR10:
+        return bggr;
+    default:
+        return NULL;
+    }
+}
+
+/* 10-bit Bayer samples are stored in the low bits of 16-bit words */
+static bool is_bayer10(__u32 fourcc)
+{
+    return fourcc == V4L2_PIX_FMT_SRGGB10 || fourcc == V4L2_PIX_FMT_SGRBG10 ||
+           fourcc == V4L2_PIX_FMT_SGBRG10 || fourcc == V4L2_PIX_FMT_SBGGR10;
+}
+
+/* Formats carrying more than 8 bits per sample, converted through the
+ * 16-bit pipeline.
+ */
+static bool is_high_bit_depth(__u32 fourcc)
+{
+    return fourcc == V4L2_PIX_FMT_Y10 || fourcc == V4L2_PIX_FMT_P010;
+}
+
+static void set_pix_format_size(struct v4l2_pix_format *fmt)
+{
+    if (bayer_cfa_order(fmt->pixelformat)) {
+        fmt->bytesperline =
+            is_bayer10(fmt->pixelformat) ? fmt->width << 1 : fmt->width;
+        fmt->sizeimage = fmt->bytesperline * fmt->height;
+        fmt->colorspace = V4L2_COLORSPACE_RAW;
+        return;
+    }
+
+    switch (fmt->pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+        fmt->bytesperline = fmt->width << 1;
+        fmt->sizeimage = fmt->bytesperline * fmt->height;
+        fmt->colorspace = V4L2_COLORSPACE_SMPTE170M;
+        break;
+    case V4L2_PIX_FMT_Y10:
+        fmt->bytesperline = fmt->width << 1;
+        fmt->sizeimage = fmt->bytesperline * fmt->height;
+        fmt->colorspace = V4L2_COLORSPACE_SMPTE170M;
+        break;
+    case V4L2_PIX_FMT_P010:
+        /* Luma plane followed by the interleaved half-height CbCr plane,
+         * whose last row also covers the last luma row of an odd height
+         */
+        fmt->bytesperline = fmt->width << 1;
+        fmt->sizeimage =
+            fmt->bytesperline * (fmt->height + DIV_ROUND_UP(fmt->height, 2));
+        fmt->colorspace = V4L2_COLORSPACE_SMPTE170M;
+        break;
+    case V4L2_PIX_FMT_MJPEG:
+        /* Room for the headers and 16 bits per pixel, the encoder lowers
+         * the quality of frames that would not fit. The real size is
+         * reported via bytesused.
+         */
+        fmt->bytesperline = 0;
+        fmt->sizeimage =
+            ((fmt->width * fmt->height) << 1) + VCAM_JPEG_HEADERS_SIZE;
+        fmt->colorspace = V4L2_COLORSPACE_JPEG;
+        break;
+    default:
+        fmt->bytesperline = fmt->width * 3;
+        fmt->sizeimage = fmt->bytesperline * fmt->height;
+        fmt->colorspace = V4L2_COLORSPACE_SRGB;
+        break;
+    }
+}
+
 static void negotiate_resolution(__u32 *width, __u32 *height)
 {
     int n_avail = ARRAY_SIZE(vcam_sizes);
@@ -142,22 +311,23 @@ static int vcam_try_fmt_vid_cap(struct file *file,
                                 void *priv,
                                 struct v4l2_format *f)
 {
-    struct vcam_device *dev = (struct vcam_device *) video_drvdata(file);
+    struct vcam_output *out = video_drvdata(file);
+    struct vcam_device *dev = out->dev;
 
     if (!check_supported_pixfmt(dev, f->fmt.pix.pixelformat)) {
-        f->fmt.pix.pixelformat = dev->output_format.pixelformat;
+        f->fmt.pix.pixelformat = out->output_format.pixelformat;
         pr_debug("Unsupported\n");
     }
 
     if (!dev->conv_res_on) {
         pr_debug("Resolution conversion is %d\n", dev->conv_res_on);
-        f->fmt.pix.width = dev->output_format.width;
-        f->fmt.pix.height = dev->output_format.height;
+        f->fmt.pix.width = dev->input_format.width;
+        f->fmt.pix.height = dev->input_format.height;
     } else if (!dev->conv_crop_on) {
         negotiate_resolution(&f->fmt.pix.width, &f->fmt.pix.height);
     } else {
         /* set the cropping rectangular resolution */
-        struct crop_ratio cropratio = dev->fb_spec.cropratio;
+        struct crop_ratio cropratio = dev->config.spec.cropratio;
         f->fmt.pix.width =
             f->fmt.pix.width / cropratio.numerator * cropratio.denominator;
         f->fmt.pix.height =
@@ -167,14 +337,7 @@ static int vcam_try_fmt_vid_cap(struct file *file,
     }
 
     f->fmt.pix.field = V4L2_FIELD_NONE;
-    if (f->fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV) {
-        f->fmt.pix.bytesperline = f->fmt.pix.width << 1;
-        f->fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
-    } else {
-        f->fmt.pix.bytesperline = f->fmt.pix.width * 3;
-        f->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
-    }
-    f->fmt.pix.sizeimage = f->fmt.pix.bytesperline * f->fmt.pix.height;
+    set_pix_format_size(&f->fmt.pix);
 
     return 0;
 }
@@ -185,16 +348,20 @@ static int vcam_s_fmt_vid_cap(struct file *file,
 {
     int ret;
 
-    struct vcam_device *dev = (struct vcam_device *) video_drvdata(file);
+    struct vcam_output *out = video_drvdata(file);
 
     ret = vcam_try_fmt_vid_cap(file, priv, f);
     if (ret < 0)
         return ret;
 
-    dev->output_format = f->fmt.pix;
+    if (vb2_is_busy(&out->vb_out_vidq))
+        return -EBUSY;
+
+    out->output_format = f->fmt.pix;
+    out->source_changed = false;
 
-    pr_debug("Resolution set to %dx%d\n", dev->output_format.width,
-             dev->output_format.height);
+    pr_debug("Resolution set to %dx%d\n", out->output_format.width,
+             out->output_format.height);
     return 0;
 }
 
@@ -203,7 +370,8 @@ static int vcam_enum_frameintervals(struct file *file,
                                     struct v4l2_frmivalenum *fival)
 {
     struct v4l2_frmival_stepwise *frm_step;
-    struct vcam_device *dev = (struct vcam_device *) video_drvdata(file);
+    struct vcam_output *out = video_drvdata(file);
+    struct vcam_device *dev = out->dev;
 
     if (fival->index > 0) {
         pr_debug("Index out of range\n");
@@ -216,8 +384,8 @@ static int vcam_enum_frameintervals(struct file *file,
     }
 
     if (!dev->conv_res_on) {
-        if ((fival->width != dev->output_format.width) ||
-            (fival->height != dev->output_format.height)) {
+        if ((fival->width != out->output_format.width) ||
+            (fival->height != out->output_format.height)) {
             pr_debug("Unsupported resolution\n");
             return -EINVAL;
         }
@@ -230,12 +398,12 @@ static int vcam_enum_frameintervals(struct file *file,
 
     fival->type = V4L2_FRMIVAL_TYPE_STEPWISE;
     frm_step = &fival->stepwise;
-    frm_step->min.numerator = 1001;
-    frm_step->min.denominator = 60000;
-    frm_step->max.numerator = 1001;
-    frm_step->max.denominator = 1001;
-    frm_step->step.numerator = 1001;
-    frm_step->step.denominator = 60000;
+    frm_step->min.numerator = 1;
+    frm_step->min.denominator = VCAM_FPS_MAX;
+    frm_step->max.numerator = 1;
+    frm_step->max.denominator = 1;
+    frm_step->step.numerator = 1;
+    frm_step->step.denominator = VCAM_FPS_MAX;
 
     return 0;
 }
@@ -244,18 +412,18 @@ static int vcam_g_parm(struct file *file,
                        void *priv,
                        struct v4l2_streamparm *sp)
 {
-    struct vcam_device *dev;
+    struct vcam_output *out;
     struct v4l2_captureparm *cp;
 
     if (sp->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
         return -EINVAL;
 
     cp = &sp->parm.capture;
-    dev = (struct vcam_device *) video_drvdata(file);
+    out = video_drvdata(file);
 
     memset(cp, 0x00, sizeof(struct v4l2_captureparm));
     cp->capability = V4L2_CAP_TIMEPERFRAME;
-    cp->timeperframe = dev->output_fps;
+    cp->timeperframe = out->output_fps;
     cp->extendedmode = 0;
     cp->readbuffers = 1;
 
@@ -266,23 +434,37 @@ static int vcam_s_parm(struct file *file,
                        void *priv,
                        struct v4l2_streamparm *sp)
 {
-    struct vcam_device *dev;
+    struct vcam_output *out;
     struct v4l2_captureparm *cp;
 
     if (sp->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
         return -EINVAL;
 
     cp = &sp->parm.capture;
-    dev = (struct vcam_device *) video_drvdata(file);
+    out = video_drvdata(file);
 
     cp->capability = V4L2_CAP_TIMEPERFRAME;
-    if (!cp->timeperframe.numerator || !cp->timeperframe.denominator)
-        cp->timeperframe = dev->output_fps;
-    else
-        dev->output_fps = cp->timeperframe;
+    if (!cp->timeperframe.numerator || !cp->timeperframe.denominator) {
+        cp->timeperframe = out->output_fps;
+    } else {
+        /* Clamp to the frame interval range enumerated */
+        if ((u64) cp->timeperframe.numerator * VCAM_FPS_MAX <
+            cp->timeperframe.denominator) {
+            cp->timeperframe.numerator = 1;
+            cp->timeperframe.denominator = VCAM_FPS_MAX;
+        } else if (cp->timeperframe.numerator > cp->timeperframe.denominator) {
+            cp->timeperframe.numerator = 1;
+            cp->timeperframe.denominator = 1;
+        }
+        out->output_fps = cp->timeperframe;
+    }
     cp->extendedmode = 0;
     cp->readbuffers = 1;
 
+    /* A deadline period follows the frame interval */
+    if (out->sub_thr_id)
+        vcam_place_submitter(out);
+
     pr_debug("FPS set to %d/%d\n", cp->timeperframe.numerator,
              cp->timeperframe.denominator);
     return 0;
@@ -294,7 +476,8 @@ static int vcam_enum_framesizes(struct file *file,
 {
     struct v4l2_frmsize_discrete *size_discrete;
 
-    struct vcam_device *dev = (struct vcam_device *) video_drvdata(file);
+    struct vcam_output *out = video_drvdata(file);
+    struct vcam_device *dev = out->dev;
     if (!check_supported_pixfmt(dev, fsize->pixel_format))
         return -EINVAL;
 
@@ -304,8 +487,8 @@ static int vcam_enum_framesizes(struct file *file,
 
         fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
         size_discrete = &fsize->discrete;
-        size_discrete->width = dev->output_format.width;
-        size_discrete->height = dev->output_format.height;
+        size_discrete->width = out->output_format.width;
+        size_discrete->height = out->output_format.height;
     } else {
         if (fsize->index >= ARRAY_SIZE(vcam_sizes))
             return -EINVAL;
@@ -319,6 +502,14 @@ static int vcam_enum_framesizes(struct file *file,
     return 0;
 }
 
+static int vcam_subscribe_event(struct v4l2_fh *fh,
+                                const struct v4l2_event_subscription *sub)
+{
+    if (sub->type == V4L2_EVENT_SOURCE_CHANGE)
+        return v4l2_src_change_event_subscribe(fh, sub);
+    return v4l2_ctrl_subscribe_event(fh, sub);
+}
+
 static const struct v4l2_ioctl_ops vcam_ioctl_ops = {
     .vidioc_querycap = vcam_querycap,
     .vidioc_enum_input = vcam_enum_input,
@@ -340,7 +531,113 @@ static const struct v4l2_ioctl_ops vcam_ioctl_ops = {
     .vidioc_dqbuf = vb2_ioctl_dqbuf,
     .vidioc_expbuf = vb2_ioctl_expbuf,
     .vidioc_streamon = vb2_ioctl_streamon,
-    .vidioc_streamoff = vb2_ioctl_streamoff};
+    .vidioc_streamoff = vb2_ioctl_streamoff,
+    .vidioc_log_status = v4l2_ctrl_log_status,
+    .vidioc_subscribe_event = vcam_subscribe_event,
+    .vidioc_unsubscribe_event = v4l2_event_unsubscribe};
+
+static int vcam_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+    struct vcam_output *out =
+        container_of(ctrl->handler, struct vcam_output, ctrl_handler);
+
+    switch (ctrl->id) {
+    case V4L2_CID_JPEG_COMPRESSION_QUALITY:
+        out->jpeg_quality = ctrl->val;
+        break;
+    case V4L2_CID_TEST_PATTERN:
+        out->test_pattern = ctrl->val;
+        break;
+    case VCAM_CID_DELIVERY_POLICY:
+        out->delivery_policy = ctrl->val;
+        break;
+    case VCAM_CID_OVERLOAD_STRATEGY:
+        out->overload.strategy = ctrl->val;
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int vcam_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+    struct vcam_output *out =
+        container_of(ctrl->handler, struct vcam_output, ctrl_handler);
+
+    switch (ctrl->id) {
+    case VCAM_CID_SKIPPED_FRAMES:
+        *ctrl->p_new.p_s64 = out->skipped;
+        break;
+    case VCAM_CID_DELIVERY_TIMES:
+        memcpy(ctrl->p_new.p_s64, out->delivery_time,
+               sizeof(out->delivery_time));
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const struct v4l2_ctrl_ops vcam_ctrl_ops = {
+    .g_volatile_ctrl = vcam_g_volatile_ctrl,
+    .s_ctrl = vcam_s_ctrl,
+};
+
+static const char *const vcam_delivery_policies[] = {
+    [VCAM_DELIVERY_MAILBOX] = "Mailbox",
+    [VCAM_DELIVERY_FIFO] = "FIFO",
+};
+
+static const struct v4l2_ctrl_config vcam_ctrl_delivery_policy = {
+    .ops = &vcam_ctrl_ops,
+    .id = VCAM_CID_DELIVERY_POLICY,
+    .name = "Delivery Policy",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .max = VCAM_DELIVERY_FIFO,
+    .def = VCAM_DELIVERY_MAILBOX,
+    .qmenu = vcam_delivery_policies,
+};
+
+static const char *const vcam_overload_strategies[] = {
+    [VCAM_OVERLOAD_DROP] = "Drop Frames",
+    [VCAM_OVERLOAD_FAST_SCALER] = "Fast Scaler",
+    [VCAM_OVERLOAD_LOW_QUALITY] = "Reduce Quality",
+};
+
+static const struct v4l2_ctrl_config vcam_ctrl_overload_strategy = {
+    .ops = &vcam_ctrl_ops,
+    .id = VCAM_CID_OVERLOAD_STRATEGY,
+    .name = "Overload Strategy",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .max = VCAM_OVERLOAD_LOW_QUALITY,
+    .def = VCAM_OVERLOAD_DROP,
+    .qmenu = vcam_overload_strategies,
+};
+
+static const struct v4l2_ctrl_config vcam_ctrl_skipped_frames = {
+    .ops = &vcam_ctrl_ops,
+    .id = VCAM_CID_SKIPPED_FRAMES,
+    .name = "Skipped Frames",
+    .type = V4L2_CTRL_TYPE_INTEGER64,
+    .max = S64_MAX,
+    .step = 1,
+    .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+};
+
+/* Only valid for a buffer between its DQBUF and its next QBUF, see
+ * VCAM_CID_DELIVERY_TIMES.
+ */
+static const struct v4l2_ctrl_config vcam_ctrl_delivery_times = {
+    .ops = &vcam_ctrl_ops,
+    .id = VCAM_CID_DELIVERY_TIMES,
+    .name = "Buffer Delivery Times",
+    .type = V4L2_CTRL_TYPE_INTEGER64,
+    .max = S64_MAX,
+    .step = 1,
+    .dims = {VB2_MAX_FRAME},
+    .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+};
 
 static const struct video_device vcam_video_device_template = {
     .fops = &vcam_fops,
@@ -428,20 +725,43 @@ static inline void yuyv_to_rgb24_one_pix(void *dst,
     rgb[2] = (unsigned char) b;
 }
 
-static void submit_noinput_buffer(struct vcam_out_buffer *buf,
-                                  struct vcam_device *dev)
+static void fill_noinput_pattern(void *vbuf_ptr,
+                                 const struct v4l2_pix_format *fmt)
 {
     int i, j;
     int32_t yuyv_tmp;
     unsigned char *yuyv_helper = (unsigned char *) &yuyv_tmp;
-    void *vbuf_ptr = vb2_plane_vaddr(&buf->vb.vb2_buf, 0);
     int32_t *yuyv_ptr = vbuf_ptr;
-    size_t size = dev->output_format.sizeimage;
-    size_t rowsize = dev->output_format.bytesperline;
-    size_t rows = dev->output_format.height;
+    size_t size = fmt->sizeimage;
+    size_t rowsize = fmt->bytesperline;
+    size_t rows = fmt->height;
 
     int stripe_size = (rows / 255);
-    if (dev->output_format.pixelformat == V4L2_PIX_FMT_YUYV) {
+    if (fmt->pixelformat == V4L2_PIX_FMT_P010) {
+        uint16_t *p010_ptr = vbuf_ptr;
+        size_t luma_size = rowsize * rows;
+
+        for (i = 0; i < 255; i++) {
+            for (j = 0; j < ((rowsize * stripe_size) >> 1); j++)
+                *p010_ptr++ = i << 8;
+        }
+
+        while ((void *) p010_ptr < (void *) ((void *) vbuf_ptr + luma_size))
+            *p010_ptr++ = 0xffc0;
+        while ((void *) p010_ptr < (void *) ((void *) vbuf_ptr + size))
+            *p010_ptr++ = 0x8000;
+    } else if (is_bayer10(fmt->pixelformat) ||
+               fmt->pixelformat == V4L2_PIX_FMT_Y10) {
+        uint16_t *raw_ptr = vbuf_ptr;
+
+        for (i = 0; i < 255; i++) {
+            for (j = 0; j < ((rowsize * stripe_size) >> 1); j++)
+                *raw_ptr++ = i << 2;
+        }
+
+        while ((void *) raw_ptr < (void *) ((void *) vbuf_ptr + size))
+            *raw_ptr++ = 0x3ff;
+    } else if (fmt->pixelformat == V4L2_PIX_FMT_YUYV) {
         yuyv_tmp = 0x80808080;
 
         for (i = 0; i < 255; i++) {
@@ -467,30 +787,70 @@ static void submit_noinput_buffer(struct vcam_out_buffer *buf,
         if (rows % 255)
             memset(vbuf_ptr, 0xff, rowsize * (rows % 255));
     }
+}
 
-    buf->vb.vb2_buf.timestamp = ktime_get_ns();
-    vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+/* Complete @buf as the next frame of @out. The id of the input frame it
+ * shows is carried in the timecode user bits, so consumers can tell a
+ * repeated frame from a new one, while gaps in the sequence number are
+ * dropped frames. The timestamp is the capture time of the input frame, and
+ * the delivery time is kept for VCAM_CID_DELIVERY_TIMES until the buffer is
+ * completed again.
+ */
+static void vcam_out_buffer_done(struct vcam_output *out,
+                                 struct vcam_out_buffer *buf,
+                                 enum vb2_buffer_state state)
+{
+    struct vb2_v4l2_buffer *vbuf = &buf->vb;
+    unsigned int input = buf->input_sequence;
+    u64 timestamp = buf->input_timestamp;
+    __le32 id = cpu_to_le32(input);
+    u64 now = ktime_get_ns();
+
+    vbuf->field = V4L2_FIELD_NONE;
+    vbuf->sequence = out->sequence++;
+    vbuf->flags |= V4L2_BUF_FLAG_TIMECODE;
+    memset(&vbuf->timecode, 0, sizeof(vbuf->timecode));
+    vbuf->timecode.flags = V4L2_TC_USERBITS_USERDEFINED;
+    memcpy(vbuf->timecode.userbits, &id, sizeof(id));
+    /* Producers may stamp frames with a capture time ahead of their write */
+    if (timestamp && timestamp < now)
+        vcam_hist_record(out->dev->stats, VCAM_HIST_LATENCY, now - timestamp);
+    vbuf->vb2_buf.timestamp = timestamp ? timestamp : now;
+    out->delivery_time[vbuf->vb2_buf.index] = now;
+    vcam_stat_inc(out->dev->stats, VCAM_STAT_DELIVERED);
+    if (state == VB2_BUF_STATE_DONE)
+        vcam_stat_add(out->dev->stats, VCAM_STAT_OUTPUT_BYTES,
+                      vb2_get_plane_payload(&vbuf->vb2_buf, 0));
+    if (input == out->last_input && !buf->pattern_changed)
+        vcam_stat_inc(out->dev->stats, VCAM_STAT_REPEATED);
+    buf->pattern_changed = false;
+    out->last_input = input;
+    out->fps_frames++;
+    vb2_buffer_done(&vbuf->vb2_buf, state);
 }
 
 static void copy_scale(unsigned char *dst,
                        unsigned char *src,
-                       struct vcam_device *dev)
+                       const struct v4l2_pix_format *in_fmt,
+                       const struct v4l2_pix_format *out_fmt,
+                       uint32_t y0,
+                       uint32_t y1)
 {
-    uint32_t dst_height = dev->output_format.height;
-    uint32_t dst_width = dev->output_format.width;
-    uint32_t src_height = dev->input_format.height;
-    uint32_t src_width = dev->input_format.width;
+    uint32_t dst_height = out_fmt->height;
+    uint32_t dst_width = out_fmt->width;
+    uint32_t src_height = in_fmt->height;
+    uint32_t src_width = in_fmt->width;
     uint32_t ratio_height = ((src_height << 16) / dst_height) + 1;
     int i, j;
 
-    if (dev->output_format.pixelformat == V4L2_PIX_FMT_YUYV) {
+    if (out_fmt->pixelformat == V4L2_PIX_FMT_YUYV) {
         uint32_t *yuyv_dst = (uint32_t *) dst;
         uint32_t *yuyv_src = (uint32_t *) src;
         uint32_t ratio_width;
         dst_width >>= 1;
         src_width >>= 1;
         ratio_width = ((src_width << 16) / dst_width) + 1;
-        for (i = 0; i < dst_height; i++) {
+        for (i = y0; i < y1; i++) {
             int tmp1 = ((i * ratio_height) >> 16);
             for (j = 0; j < dst_width; j++) {
                 int tmp2 = ((j * ratio_width) >> 16);
@@ -499,11 +859,11 @@ static void copy_scale(unsigned char *dst,
             }
         }
 
-    } else if (dev->output_format.pixelformat == V4L2_PIX_FMT_RGB24) {
+    } else if (out_fmt->pixelformat == V4L2_PIX_FMT_RGB24) {
         struct rgb_struct *yuyv_dst = (struct rgb_struct *) dst;
         struct rgb_struct *yuyv_src = (struct rgb_struct *) src;
         uint32_t ratio_width = ((src_width << 16) / dst_width) + 1;
-        for (i = 0; i < dst_height; i++) {
+        for (i = y0; i < y1; i++) {
             int tmp1 = ((i * ratio_height) >> 16);
             for (j = 0; j < dst_width; j++) {
                 int tmp2 = ((j * ratio_width) >> 16);
@@ -516,12 +876,15 @@ static void copy_scale(unsigned char *dst,
 
 static void copy_scale_rgb24_to_yuyv(unsigned char *dst,
                                      unsigned char *src,
-                                     struct vcam_device *dev)
+                                     const struct v4l2_pix_format *in_fmt,
+                                     const struct v4l2_pix_format *out_fmt,
+                                     uint32_t y0,
+                                     uint32_t y1)
 {
-    uint32_t dst_height = dev->output_format.height;
-    uint32_t dst_width = dev->output_format.width;
-    uint32_t src_height = dev->input_format.height;
-    uint32_t src_width = dev->input_format.width;
+    uint32_t dst_height = out_fmt->height;
+    uint32_t dst_width = out_fmt->width;
+    uint32_t src_height = in_fmt->height;
+    uint32_t src_width = in_fmt->width;
     uint32_t ratio_height = ((src_height << 16) / dst_height) + 1;
     uint32_t ratio_width;
     int i, j;
@@ -531,7 +894,8 @@ static void copy_scale_rgb24_to_yuyv(unsigned char *dst,
     dst_width >>= 1;
     src_width >>= 1;
     ratio_width = ((src_width << 16) / dst_width) + 1;
-    for (i = 0; i < dst_height; i++) {
+    yuyv_dst += y0 * dst_width;
+    for (i = y0; i < y1; i++) {
         int tmp1 = ((i * ratio_height) >> 16);
         for (j = 0; j < dst_width; j++) {
             int tmp2 = ((j * ratio_width) >> 16);
@@ -544,19 +908,22 @@ static void copy_scale_rgb24_to_yuyv(unsigned char *dst,
 
 static void copy_scale_yuyv_to_rgb24(unsigned char *dst,
                                      unsigned char *src,
-                                     struct vcam_device *dev)
+                                     const struct v4l2_pix_format *in_fmt,
+                                     const struct v4l2_pix_format *out_fmt,
+                                     uint32_t y0,
+                                     uint32_t y1)
 {
-    uint32_t dst_height = dev->output_format.height;
-    uint32_t dst_width = dev->output_format.width;
-    uint32_t src_height = dev->input_format.height;
-    uint32_t src_width = dev->input_format.width;
+    uint32_t dst_height = out_fmt->height;
+    uint32_t dst_width = out_fmt->width;
+    uint32_t src_height = in_fmt->height;
+    uint32_t src_width = in_fmt->width;
     uint32_t ratio_height = ((src_height << 16) / dst_height) + 1;
     uint32_t ratio_width = ((src_width << 16) / dst_width) + 1;
     int i, j;
 
-    struct rgb_struct *rgb_dst = (struct rgb_struct *) dst;
+    struct rgb_struct *rgb_dst = (struct rgb_struct *) dst + y0 * dst_width;
     int32_t *yuyv_src = (int32_t *) src;
-    for (i = 0; i < dst_height; i++) {
+    for (i = y0; i < y1; i++) {
         int tmp1 = ((i * ratio_height) >> 16);
         for (j = 0; j < dst_width; j++) {
             int tmp2 = ((j * ratio_width) >> 16);
@@ -568,6 +935,204 @@ static void copy_scale_yuyv_to_rgb24(unsigned char *dst,
     }
 }
 
+static void copy_scale_to_bayer(unsigned char *dst,
+                                unsigned char *src,
+                                const struct v4l2_pix_format *in_fmt,
+                                const struct v4l2_pix_format *out_fmt,
+                                uint32_t y0,
+                                uint32_t y1)
+{
+    uint32_t dst_height = out_fmt->height;
+    uint32_t dst_width = out_fmt->width;
+    uint32_t src_height = in_fmt->height;
+    uint32_t src_width = in_fmt->width;
+    uint32_t ratio_height = ((src_height << 16) / dst_height) + 1;
+    uint32_t ratio_width = ((src_width << 16) / dst_width) + 1;
+    const unsigned char *cfa =
+        bayer_cfa_order(out_fmt->pixelformat);
+    bool wide = is_bayer10(out_fmt->pixelformat);
+    bool yuyv = in_fmt->pixelformat == V4L2_PIX_FMT_YUYV;
+    int i, j;
+
+    dst += y0 * out_fmt->bytesperline;
+    for (i = y0; i < y1; i++) {
+        unsigned char *row =
+            src + ((i * ratio_height) >> 16) * in_fmt->bytesperline;
+        const unsigned char *cell = cfa + ((i & 1) << 1);
+        for (j = 0; j < dst_width; j++) {
+            uint32_t sx = (j * ratio_width) >> 16;
+            unsigned char ch = cell[j & 1];
+            int v;
+
+            if (yuyv) {
+                /* Compute only the channel sampled at this site */
+                unsigned char *yuyv_px = row + ((sx & ~1) << 1);
+                int c = yuyv_px[(sx & 1) << 1] - 16;
+                int d = yuyv_px[1] - 128;
+                int e = yuyv_px[3] - 128;
+
+                if (ch == 0)
+                    v = (298 * c + 409 * e + 128) >> 8;
+                else if (ch == 1)
+                    v = (298 * c - 100 * d - 208 * e + 128) >> 8;
+                else
+                    v = (298 * c + 516 * d + 128) >> 8;
+                v = v > 255 ? 255 : v;
+                v = v < 0 ? 0 : v;
+            } else {
+                v = row[sx * 3 + ch];
+            }
+
+            if (wide)
+                ((uint16_t *) dst)[j] = (v << 2) | (v >> 6);
+            else
+                dst[j] = v;
+        }
+        dst += out_fmt->bytesperline;
+    }
+}
+
+/* Limited range YCbCr sample with 16-bit precision: 8-bit values are
+ * shifted left by 8, 10-bit values by 6.
+ */
+struct yuv16 {
+    uint16_t y, u, v;
+};
+
+static inline void fetch_yuv16(struct yuv16 *px,
+                               const unsigned char *src,
+                               const struct v4l2_pix_format *fmt,
+                               uint32_t x,
+                               uint32_t y)
+{
+    const unsigned char *row = src + y * fmt->bytesperline;
+
+    switch (fmt->pixelformat) {
+    case V4L2_PIX_FMT_P010: {
+        const uint16_t *uv = (const uint16_t *) (src + fmt->bytesperline *
+                                                           fmt->height +
+                                                       (y >> 1) *
+                                                           fmt->bytesperline) +
+                             (x & ~1);
+        px->y = ((const uint16_t *) row)[x] & 0xffc0;
+        px->u = uv[0] & 0xffc0;
+        px->v = uv[1] & 0xffc0;
+        break;
+    }
+    case V4L2_PIX_FMT_Y10:
+        px->y = ((const uint16_t *) row)[x] << 6;
+        px->u = 0x8000;
+        px->v = 0x8000;
+        break;
+    case V4L2_PIX_FMT_YUYV: {
+        const unsigned char *yuyv = row + ((x & ~1) << 1);
+        px->y = yuyv[(x & 1) << 1] << 8;
+        px->u = yuyv[1] << 8;
+        px->v = yuyv[3] << 8;
+        break;
+    }
+    default: {
+        const unsigned char *rgb = row + x * 3;
+        px->y = 66 * rgb[0] + 129 * rgb[1] + 25 * rgb[2] + (16 << 8);
+        px->u = -38 * rgb[0] - 74 * rgb[1] + 112 * rgb[2] + (128 << 8);
+        px->v = 112 * rgb[0] - 94 * rgb[1] - 18 * rgb[2] + (128 << 8);
+        break;
+    }
+    }
+}
+
+/* Convert to a 10-bit RGB channel (0: R, 1: G, 2: B) */
+static inline int yuv16_to_channel10(const struct yuv16 *px, int ch)
+{
+    int c = px->y - (16 << 8);
+    int d = px->u - (128 << 8);
+    int e = px->v - (128 << 8);
+    int v;
+
+    if (ch == 0)
+        v = (298 * c + 409 * e + (128 << 6)) >> 14;
+    else if (ch == 1)
+        v = (298 * c - 100 * d - 208 * e + (128 << 6)) >> 14;
+    else
+        v = (298 * c + 516 * d + (128 << 6)) >> 14;
+    v = v > 1023 ? 1023 : v;
+    v = v < 0 ? 0 : v;
+    return v;
+}
+
+static inline void store_yuv16(unsigned char *dst,
+                               const struct v4l2_pix_format *fmt,
+                               const struct yuv16 *px,
+                               uint32_t x,
+                               uint32_t y)
+{
+    unsigned char *row = dst + y * fmt->bytesperline;
+    const unsigned char *cfa = bayer_cfa_order(fmt->pixelformat);
+
+    if (cfa) {
+        int v = yuv16_to_channel10(px, cfa[((y & 1) << 1) | (x & 1)]);
+        if (is_bayer10(fmt->pixelformat))
+            ((uint16_t *) row)[x] = v;
+        else
+            row[x] = v >> 2;
+        return;
+    }
+
+    switch (fmt->pixelformat) {
+    case V4L2_PIX_FMT_P010:
+        ((uint16_t *) row)[x] = px->y & 0xffc0;
+        /* Chroma is sampled at the top-left pixel of each 2x2 block */
+        if (!((x | y) & 1)) {
+            uint16_t *uv =
+                (uint16_t *) (dst + fmt->bytesperline * fmt->height +
+                              (y >> 1) * fmt->bytesperline) +
+                x;
+            uv[0] = px->u & 0xffc0;
+            uv[1] = px->v & 0xffc0;
+        }
+        break;
+    case V4L2_PIX_FMT_Y10:
+        ((uint16_t *) row)[x] = px->y >> 6;
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        row[x << 1] = px->y >> 8;
+        if (!(x & 1)) {
+            row[(x << 1) + 1] = px->u >> 8;
+            row[(x << 1) + 3] = px->v >> 8;
+        }
+        break;
+    default:
+        row[x * 3] = yuv16_to_channel10(px, 0) >> 2;
+        row[x * 3 + 1] = yuv16_to_channel10(px, 1) >> 2;
+        row[x * 3 + 2] = yuv16_to_channel10(px, 2) >> 2;
+        break;
+    }
+}
+
+/* Convert and scale between any pair of formats with 16-bit intermediate
+ * precision, so 10-bit input or output is never truncated to 8 bits.
+ */
+static void copy_scale_hbd(unsigned char *dst,
+                           unsigned char *src,
+                           const struct v4l2_pix_format *in,
+                           const struct v4l2_pix_format *out,
+                           uint32_t y0,
+                           uint32_t y1)
+{
+    uint32_t ratio_height = ((in->height << 16) / out->height) + 1;
+    uint32_t ratio_width = ((in->width << 16) / out->width) + 1;
+    struct yuv16 px;
+    int i, j;
+
+    for (i = y0; i < y1; i++) {
+        uint32_t sy = (i * ratio_height) >> 16;
+        for (j = 0; j < out->width; j++) {
+            fetch_yuv16(&px, src, in, (j * ratio_width) >> 16, sy);
+            store_yuv16(dst, out, &px, j, i);
+        }
+    }
+}
+
 static void convert_rgb24_buf_to_yuyv(unsigned char *dst,
                                       unsigned char *src,
                                       size_t pixel_count)
@@ -594,42 +1159,234 @@ static void convert_yuyv_buf_to_rgb24(unsigned char *dst,
     }
 }
 
-static void submit_copy_buffer(struct vcam_out_buffer *out_buf,
-                               struct vcam_in_buffer *in_buf,
-                               struct vcam_device *dev)
+/* No-input test patterns. The static part of a pattern is rendered once per
+ * format into the pattern frame of the node, then copied into each buffer;
+ * moving patterns paint only their changing part on top of the copy.
+ */
+static const char *const vcam_test_patterns[] = {
+    [VCAM_PATTERN_GRADIENT] = "Gradient",
+    [VCAM_PATTERN_COLOR_BARS] = "Colour Bars",
+    [VCAM_PATTERN_MOVING_BOX] = "Moving Box",
+    [VCAM_PATTERN_FRAME_COUNTER] = "Frame Counter",
+};
+
+/* 75% colour bars: white, yellow, cyan, green, magenta, red, blue, black */
+static const struct yuv16 vcam_color_bars[] = {
+    {180 << 8, 128 << 8, 128 << 8}, {162 << 8, 44 << 8, 142 << 8},
+    {131 << 8, 156 << 8, 44 << 8},  {112 << 8, 72 << 8, 58 << 8},
+    {84 << 8, 184 << 8, 198 << 8},  {65 << 8, 100 << 8, 212 << 8},
+    {35 << 8, 212 << 8, 114 << 8},  {16 << 8, 128 << 8, 128 << 8},
+};
+
+static const struct yuv16 vcam_white = {235 << 8, 128 << 8, 128 << 8};
+static const struct yuv16 vcam_black = {16 << 8, 128 << 8, 128 << 8};
+
+static bool vcam_pattern_moves(int pattern)
+{
+    return pattern == VCAM_PATTERN_MOVING_BOX ||
+           pattern == VCAM_PATTERN_FRAME_COUNTER;
+}
+
+/* Format the pattern is drawn in: compressed output is encoded from YUYV */
+static void vcam_pattern_format(struct vcam_output *out,
+                                struct v4l2_pix_format *fmt)
+{
+    *fmt = out->output_format;
+    if (fmt->pixelformat == V4L2_PIX_FMT_MJPEG) {
+        fmt->pixelformat = V4L2_PIX_FMT_YUYV;
+        set_pix_format_size(fmt);
+    }
+}
+
+static void paint_rect(void *dst,
+                       const struct v4l2_pix_format *fmt,
+                       const struct yuv16 *px,
+                       uint32_t x0,
+                       uint32_t y0,
+                       uint32_t x1,
+                       uint32_t y1)
 {
-    void *in_vbuf_ptr, *out_vbuf_ptr;
+    uint32_t x, y;
 
-    in_vbuf_ptr = in_buf->data;
-    if (!in_vbuf_ptr) {
-        pr_err("Input buffer is NULL in ready state\n");
-        return;
+    for (y = y0; y < y1; y++) {
+        for (x = x0; x < x1; x++)
+            store_yuv16(dst, fmt, px, x, y);
     }
-    out_vbuf_ptr = vb2_plane_vaddr(&out_buf->vb.vb2_buf, 0);
-    if (!out_vbuf_ptr) {
-        pr_err("Output buffer is NULL\n");
+}
+
+static void render_pattern_base(void *dst,
+                                const struct v4l2_pix_format *fmt,
+                                int pattern)
+{
+    uint32_t bar_width = fmt->width / ARRAY_SIZE(vcam_color_bars);
+    int i;
+
+    if (pattern == VCAM_PATTERN_GRADIENT) {
+        fill_noinput_pattern(dst, fmt);
         return;
     }
 
-    if (dev->output_format.pixelformat == dev->input_format.pixelformat) {
+    for (i = 0; i < ARRAY_SIZE(vcam_color_bars); i++) {
+        uint32_t x1 = i == ARRAY_SIZE(vcam_color_bars) - 1
+                          ? fmt->width
+                          : (i + 1) * bar_width;
+        paint_rect(dst, fmt, &vcam_color_bars[i], i * bar_width, 0, x1,
+                   fmt->height);
+    }
+}
+
+/* Position of an object of @size bouncing back and forth in @range pixels */
+static uint32_t bounce(unsigned int frame,
+                       uint32_t step,
+                       uint32_t range,
+                       uint32_t size)
+{
+    uint32_t span = range > size ? range - size : 0;
+    uint32_t pos;
+
+    if (!span)
+        return 0;
+    pos = (frame * step) % (span << 1);
+    pos = pos < span ? pos : (span << 1) - pos;
+    return pos & ~1;
+}
+
+/* Paint the parts of @pattern that change with the frame number @frame.
+ * The frame counter is a barcode across the top of the frame: 32 cells, the
+ * most significant bit first, white for 1 and black for 0.
+ */
+static void render_pattern_frame(void *dst,
+                                 const struct v4l2_pix_format *fmt,
+                                 int pattern,
+                                 unsigned int frame)
+{
+    if (pattern == VCAM_PATTERN_MOVING_BOX) {
+        uint32_t size = (fmt->height >> 2) & ~1;
+        uint32_t x = bounce(frame, 8, fmt->width, size);
+        uint32_t y = bounce(frame, 6, fmt->height, size);
+
+        paint_rect(dst, fmt, &vcam_white, x, y,
+                   min_t(uint32_t, x + size, fmt->width),
+                   min_t(uint32_t, y + size, fmt->height));
+    } else if (pattern == VCAM_PATTERN_FRAME_COUNTER) {
+        uint32_t cell = (fmt->width >> 5) & ~1;
+        uint32_t band = max_t(uint32_t, (fmt->height >> 3) & ~1, 2);
+        int i;
+
+        for (i = 0; i < 32; i++) {
+            bool one = frame & (1U << (31 - i));
+            paint_rect(dst, fmt, one ? &vcam_white : &vcam_black, i * cell, 0,
+                       (i + 1) * cell, min_t(uint32_t, band, fmt->height));
+        }
+    }
+}
+
+/* Whether a tick without input has a frame to show that was not delivered */
+static bool vcam_pattern_due(struct vcam_output *out)
+{
+    return vcam_pattern_moves(out->test_pattern) ||
+           out->pattern.id != out->test_pattern;
+}
+
+static enum vb2_buffer_state fill_noinput_buffer(struct vcam_out_buffer *buf,
+                                                 struct vcam_output *out)
+{
+    struct vcam_pattern *pat = &out->pattern;
+    void *vbuf_ptr = vb2_plane_vaddr(&buf->vb.vb2_buf, 0);
+    size_t dst_size = vb2_plane_size(&buf->vb.vb2_buf, 0);
+    size_t size = out->output_format.sizeimage;
+    int pattern = out->test_pattern;
+    struct v4l2_pix_format fmt;
+
+    buf->pattern_changed = vcam_pattern_due(out);
+    vcam_pattern_format(out, &fmt);
+    if (pat->id != pattern) {
+        render_pattern_base(pat->frame, &fmt, pattern);
+        pat->id = pattern;
+        pat->jpeg_size = 0;
+    }
+
+    if (out->output_format.pixelformat == V4L2_PIX_FMT_MJPEG) {
+        if (vcam_pattern_moves(pattern)) {
+            memcpy(out->jpeg_scratch, pat->frame, fmt.sizeimage);
+            render_pattern_frame(out->jpeg_scratch, &fmt, pattern,
+                                 out->sequence);
+            size = vcam_jpeg_encode(out->jpeg_enc, vbuf_ptr, dst_size,
+                                    out->jpeg_scratch, &fmt,
+                                    &out->output_format, out->jpeg_quality);
+        } else {
+            /* A still pattern is compressed once per quality */
+            if (!pat->jpeg_size || pat->jpeg_quality != out->jpeg_quality) {
+                pat->jpeg_size = vcam_jpeg_encode(
+                    out->jpeg_enc, pat->jpeg, out->output_format.sizeimage,
+                    pat->frame, &fmt, &out->output_format, out->jpeg_quality);
+                pat->jpeg_quality = out->jpeg_quality;
+            }
+            size = pat->jpeg_size <= dst_size ? pat->jpeg_size : 0;
+            memcpy(vbuf_ptr, pat->jpeg, size);
+        }
+    } else if (size > dst_size) {
+        size = 0;
+    } else {
+        memcpy(vbuf_ptr, pat->frame, size);
+        render_pattern_frame(vbuf_ptr, &fmt, pattern, out->sequence);
+    }
+
+    vb2_set_plane_payload(&buf->vb.vb2_buf, 0, size);
+    buf->input_sequence = VCAM_INPUT_PATTERN;
+    buf->input_timestamp = 0;
+    return size ? VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR;
+}
+
+/* Convert rows [@y0, @y1) of the capture node @out from the input frame
+ * @in_buf into @dst. A plain copy is never cached, so it always copies the
+ * whole frame.
+ */
+static void vcam_convert_rows(struct vcam_output *out,
+                              void *dst,
+                              struct vcam_in_buffer *in_buf,
+                              uint32_t y0,
+                              uint32_t y1)
+{
+    const struct v4l2_pix_format *in_fmt = &out->dev->input_format;
+    const struct v4l2_pix_format *out_fmt = &out->output_format;
+    void *in_vbuf_ptr = in_buf->data;
+    void *out_vbuf_ptr = dst;
+
+    if (is_high_bit_depth(in_fmt->pixelformat) ||
+        is_high_bit_depth(out_fmt->pixelformat)) {
+        if (out_fmt->pixelformat == in_fmt->pixelformat &&
+            out_fmt->width == in_fmt->width &&
+            out_fmt->height == in_fmt->height) {
+            pr_debug("High bit depth, no conversion\n");
+            memcpy(out_vbuf_ptr, in_vbuf_ptr, in_buf->filled);
+        } else {
+            pr_debug("High bit depth conversion\n");
+            copy_scale_hbd(out_vbuf_ptr, in_vbuf_ptr, in_fmt, out_fmt, y0, y1);
+        }
+    } else if (bayer_cfa_order(out_fmt->pixelformat)) {
+        pr_debug("Bayer mosaic\n");
+        copy_scale_to_bayer(out_vbuf_ptr, in_vbuf_ptr, in_fmt, out_fmt, y0,
+                            y1);
+    } else if (out_fmt->pixelformat == in_fmt->pixelformat) {
         pr_debug("Same pixel format\n");
-        pr_debug("%d,%d -> %d,%d\n", dev->output_format.width,
-                 dev->output_format.height, dev->input_format.width,
-                 dev->input_format.height);
-        if (dev->output_format.width == dev->input_format.width &&
-            dev->output_format.height == dev->input_format.height) {
+        pr_debug("%d,%d -> %d,%d\n", out_fmt->width, out_fmt->height,
+                 in_fmt->width, in_fmt->height);
+        if (out_fmt->width == in_fmt->width &&
+            out_fmt->height == in_fmt->height) {
             pr_debug("No scaling\n");
             memcpy(out_vbuf_ptr, in_vbuf_ptr, in_buf->filled);
         } else {
             pr_debug("Scaling\n");
-            copy_scale(out_vbuf_ptr, in_vbuf_ptr, dev);
+            copy_scale(out_vbuf_ptr, in_vbuf_ptr, in_fmt, out_fmt, y0, y1);
         }
     } else {
-        if (dev->output_format.width == dev->input_format.width &&
-            dev->output_format.height == dev->input_format.height) {
-            int pixel_count =
-                dev->input_format.height * dev->input_format.width;
-            if (dev->input_format.pixelformat == V4L2_PIX_FMT_YUYV) {
+        if (out_fmt->width == in_fmt->width &&
+            out_fmt->height == in_fmt->height) {
+            int pixel_count = (y1 - y0) * in_fmt->width;
+            out_vbuf_ptr += y0 * out_fmt->bytesperline;
+            in_vbuf_ptr += y0 * in_fmt->bytesperline;
+            if (in_fmt->pixelformat == V4L2_PIX_FMT_YUYV) {
                 pr_debug("YUYV->RGB24 no scale\n");
                 convert_yuyv_buf_to_rgb24(out_vbuf_ptr, in_vbuf_ptr,
                                           pixel_count);
@@ -639,128 +1396,940 @@ static void submit_copy_buffer(struct vcam_out_buffer *out_buf,
                                           pixel_count);
             }
         } else {
-            if (dev->output_format.pixelformat == V4L2_PIX_FMT_YUYV) {
+            if (out_fmt->pixelformat == V4L2_PIX_FMT_YUYV) {
                 pr_debug("RGB24->YUYV scale\n");
-                copy_scale_rgb24_to_yuyv(out_vbuf_ptr, in_vbuf_ptr, dev);
-            } else if (dev->output_format.pixelformat == V4L2_PIX_FMT_RGB24) {
+                copy_scale_rgb24_to_yuyv(out_vbuf_ptr, in_vbuf_ptr, in_fmt,
+                                         out_fmt, y0, y1);
+            } else if (out_fmt->pixelformat == V4L2_PIX_FMT_RGB24) {
                 pr_debug("RGB24->YUYV scale\n");
-                copy_scale_yuyv_to_rgb24(out_vbuf_ptr, in_vbuf_ptr, dev);
+                copy_scale_yuyv_to_rgb24(out_vbuf_ptr, in_vbuf_ptr, in_fmt,
+                                         out_fmt, y0, y1);
             }
         }
     }
-    out_buf->vb.vb2_buf.timestamp = ktime_get_ns();
-    vb2_buffer_done(&out_buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
 }
 
-int submitter_thread(void *data)
+/* JPEG quality @out encodes with, lowered while it is overloaded */
+static int vcam_jpeg_quality(struct vcam_output *out)
 {
-    unsigned long flags = 0;
-    struct vcam_device *dev = (struct vcam_device *) data;
-    struct vcam_out_queue *q = &dev->vcam_out_vidq;
-    struct vcam_in_queue *in_q = &dev->in_queue;
+    if (out->overload.degraded &&
+        out->overload.strategy == VCAM_OVERLOAD_LOW_QUALITY)
+        return max(out->jpeg_quality >> 1, 1);
+    return out->jpeg_quality;
+}
 
-    while (!kthread_should_stop()) {
-        struct vcam_out_buffer *buf;
-        int timeout_ms, timeout;
-
-        /* Do something and sleep */
-        int computation_time_jiff = jiffies;
-        spin_lock_irqsave(&dev->out_q_slock, flags);
-        if (list_empty(&q->active)) {
-            pr_debug("Buffer queue is empty\n");
-            spin_unlock_irqrestore(&dev->out_q_slock, flags);
-            goto have_a_nap;
-        }
-        buf = list_entry(q->active.next, struct vcam_out_buffer, list);
-        list_del(&buf->list);
-        spin_unlock_irqrestore(&dev->out_q_slock, flags);
+/* Whether @out converts only every other row while it is overloaded. Bayer
+ * rows alternate colours and a plain copy is no cheaper, so both keep every
+ * row.
+ */
+static bool vcam_halve_rows(struct vcam_output *out)
+{
+    const struct v4l2_pix_format *in_fmt = &out->dev->input_format;
+    const struct v4l2_pix_format *out_fmt = &out->output_format;
+
+    return out->overload.degraded &&
+           out->overload.strategy == VCAM_OVERLOAD_FAST_SCALER &&
+           !bayer_cfa_order(out_fmt->pixelformat) &&
+           !(out_fmt->pixelformat == in_fmt->pixelformat &&
+             out_fmt->width == in_fmt->width &&
+             out_fmt->height == in_fmt->height);
+}
 
-        if (!dev->fb_isopen) {
-            submit_noinput_buffer(buf, dev);
-        } else {
-            struct vcam_in_buffer *in_buf;
-            spin_lock_irqsave(&dev->in_q_slock, flags);
-            in_buf = in_q->ready;
-            if (!in_buf) {
-                pr_err("Ready buffer in input queue has NULL pointer\n");
-                goto unlock_and_continue;
-            }
-            submit_copy_buffer(buf, in_buf, dev);
-        unlock_and_continue:
-            spin_unlock_irqrestore(&dev->in_q_slock, flags);
-        }
+/* Convert the input frame @in_buf to the format of the capture node @out
+ * into @dst. Returns the size of the converted frame, or 0 if it does not fit
+ * into @dst_size bytes.
+ *
+ * With @dirty, @dst already holds the previous input frame converted, and
+ * only the output rows sampled from the input stripes in @dirty are
+ * converted again. Compressed formats must pass NULL.
+ */
+static size_t vcam_convert_frame(struct vcam_output *out,
+                                 void *dst,
+                                 size_t dst_size,
+                                 struct vcam_in_buffer *in_buf,
+                                 const unsigned long *dirty)
+{
+    const struct v4l2_pix_format *in_fmt = &out->dev->input_format;
+    const struct v4l2_pix_format *out_fmt = &out->output_format;
+    uint32_t ratio_height, y0, y1;
 
-    have_a_nap:
-        if (!dev->output_fps.denominator) {
-            dev->output_fps.numerator = 1001;
-            dev->output_fps.denominator = 30000;
-        }
-        timeout_ms = dev->output_fps.denominator / dev->output_fps.numerator;
-        if (!timeout_ms) {
-            dev->output_fps.numerator = 1001;
-            dev->output_fps.denominator = 60000;
-            timeout_ms =
-                dev->output_fps.denominator / dev->output_fps.numerator;
-        }
+    if (out_fmt->pixelformat == V4L2_PIX_FMT_MJPEG) {
+        return vcam_jpeg_encode(out->jpeg_enc, dst, dst_size, in_buf->data,
+                                in_fmt, out_fmt, vcam_jpeg_quality(out));
+    }
 
-        /* Compute timeout and update FPS */
-        computation_time_jiff = jiffies - computation_time_jiff;
-        timeout = msecs_to_jiffies(timeout_ms);
-        if (computation_time_jiff > timeout) {
-            int computation_time_ms = msecs_to_jiffies(computation_time_jiff);
-            dev->output_fps.numerator = 1001;
-            dev->output_fps.denominator = 1000 * computation_time_ms;
-        } else if (timeout > computation_time_jiff) {
-            schedule_timeout_interruptible(timeout - computation_time_jiff);
+    if (dst_size < out_fmt->sizeimage)
+        return 0;
+
+    if (!dirty && vcam_halve_rows(out)) {
+        /* Convert the even rows and repeat each of them below */
+        for (y0 = 0; y0 < out_fmt->height; y0 += 2) {
+            vcam_convert_rows(out, dst, in_buf, y0, y0 + 1);
+            if (y0 + 1 < out_fmt->height)
+                memcpy(dst + (y0 + 1) * out_fmt->bytesperline,
+                       dst + y0 * out_fmt->bytesperline,
+                       out_fmt->bytesperline);
         }
+        return out_fmt->sizeimage;
     }
 
-    return 0;
+    if (!dirty) {
+        vcam_convert_rows(out, dst, in_buf, 0, out_fmt->height);
+        return out_fmt->sizeimage;
+    }
+
+    ratio_height = ((in_fmt->height << 16) / out_fmt->height) + 1;
+    for (y0 = 0; y0 < out_fmt->height; y0 = y1 + 1) {
+        for (y1 = y0; y1 < out_fmt->height; y1++) {
+            if (!test_bit(vcam_stripe_of((y1 * ratio_height) >> 16), dirty))
+                break;
+        }
+        /* Rows come in pairs sharing the chroma of 4:2:0 formats */
+        if (y1 > y0)
+            vcam_convert_rows(out, dst, in_buf, y0 & ~1,
+                              min_t(uint32_t, ALIGN(y1, 2), out_fmt->height));
+    }
+    return out_fmt->sizeimage;
 }
 
-static void fill_v4l2pixfmt(struct v4l2_pix_format *fmt,
-                            struct vcam_device_spec *dev_spec)
+/* Convert through the cache entry of the output format: only the first
+ * request for a new input frame converts it, repeated ticks and the other
+ * nodes streaming the same format copy the result. When the cache holds the
+ * frame the new one was compared with, only its changed stripes are converted
+ * again. A mapped framebuffer can change behind the sequence number, so it is
+ * always converted unless the producer reports its damage. A degraded node
+ * takes the frame at either quality, a node back at full quality converts
+ * the frame all again once.
+ */
+static size_t vcam_convert_cached(struct vcam_output *out,
+                                  void *dst,
+                                  size_t dst_size,
+                                  struct vcam_in_buffer *in_buf)
 {
-    if (!fmt || !dev_spec)
-        return;
+    struct vcam_device *dev = out->dev;
+    struct vcam_conv_cache *cache = out->cache;
+    DECLARE_BITMAP(dirty, VCAM_STRIPES_MAX);
+    unsigned int sequence, base;
+    unsigned long flags = 0;
+    bool full, halved;
+    size_t size;
+
+    /* A damage report can publish the mapped frame again meanwhile */
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    sequence = in_buf->sequence;
+    base = in_buf->base_sequence;
+    bitmap_copy(dirty, in_buf->dirty, VCAM_STRIPES_MAX);
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
+
+    mutex_lock(&cache->lock);
+    halved = vcam_halve_rows(out);
+    full = !cache->valid || (dev->fb_mapped && !dev->fb_damage) ||
+           (cache->halved && !halved) ||
+           (cache->format.pixelformat == V4L2_PIX_FMT_MJPEG &&
+            cache->jpeg_quality != vcam_jpeg_quality(out));
+    if (full || cache->sequence != sequence) {
+        if (full || cache->sequence != base)
+            cache->payload = vcam_convert_frame(
+                out, cache->data, cache->format.sizeimage, in_buf, NULL);
+        else if (cache->format.pixelformat != V4L2_PIX_FMT_MJPEG)
+            vcam_convert_frame(out, cache->data, cache->format.sizeimage,
+                               in_buf, dirty);
+        else if (!bitmap_empty(dirty, VCAM_STRIPES_MAX))
+            /* Entropy coded data cannot be patched, encode it all */
+            cache->payload = vcam_convert_frame(
+                out, cache->data, cache->format.sizeimage, in_buf, NULL);
+        cache->sequence = sequence;
+        cache->jpeg_quality = vcam_jpeg_quality(out);
+        cache->halved = halved;
+        cache->valid = true;
+    }
+    size = cache->payload <= dst_size ? cache->payload : 0;
+    memcpy(dst, cache->data, size);
+    mutex_unlock(&cache->lock);
 
-    memset(fmt, 0x00, sizeof(struct v4l2_pix_format));
-    fmt->width = dev_spec->width;
-    fmt->height = dev_spec->height;
-    pr_debug("Filling %dx%d\n", dev_spec->width, dev_spec->height);
+    return size;
+}
 
-    switch (dev_spec->pix_fmt) {
-    case VCAM_PIXFMT_RGB24:
-        fmt->pixelformat = V4L2_PIX_FMT_RGB24;
-        fmt->bytesperline = (fmt->width * 3);
-        fmt->colorspace = V4L2_COLORSPACE_SRGB;
-        break;
+static enum vb2_buffer_state fill_copy_buffer(struct vcam_out_buffer *out_buf,
+                                              struct vcam_in_buffer *in_buf,
+                                              struct vcam_output *out)
+{
+    void *out_vbuf_ptr;
+    size_t dst_size, size = 0;
+
+    out_vbuf_ptr = vb2_plane_vaddr(&out_buf->vb.vb2_buf, 0);
+    dst_size = vb2_plane_size(&out_buf->vb.vb2_buf, 0);
+    if (!in_buf->data)
+        pr_err("Input buffer is NULL in ready state\n");
+    else if (!out_vbuf_ptr)
+        pr_err("Output buffer is NULL\n");
+    else if (out->cache && out->cache->format.pixelformat ==
+                                 out->output_format.pixelformat &&
+             out->cache->format.sizeimage == out->output_format.sizeimage)
+        size = vcam_convert_cached(out, out_vbuf_ptr, dst_size, in_buf);
+    else
+        size = vcam_convert_frame(out, out_vbuf_ptr, dst_size, in_buf, NULL);
+
+    vb2_set_plane_payload(&out_buf->vb.vb2_buf, 0, size);
+    out_buf->input_sequence = in_buf->sequence;
+    out_buf->input_timestamp = in_buf->timestamp;
+    return size ? VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR;
+}
+
+/* Pin the input frame @out shows next so the framebuffer writer does not
+ * reuse it while it is being converted: the newest complete frame, or with
+ * the FIFO policy the oldest one not delivered yet. The input frames passed
+ * over are never converted, and counted as skipped.
+ */
+static struct vcam_in_buffer *vcam_in_get_next(struct vcam_output *out)
+{
+    struct vcam_device *dev = out->dev;
+    struct vcam_in_queue *q = &dev->in_queue;
+    struct vcam_in_buffer *in_buf;
+    unsigned int last = out->last_input;
+    unsigned long flags = 0;
+    int i;
+
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    in_buf = q->ready;
+    if (in_buf && last != VCAM_INPUT_NONE && last != VCAM_INPUT_PATTERN &&
+        in_buf->sequence > last) {
+        for (i = 0; out->delivery_policy == VCAM_DELIVERY_FIFO &&
+                    i < q->nr_buffers;
+             i++) {
+            struct vcam_in_buffer *b = &q->buffers[i];
+            if (b != q->pending && b->filled && b->sequence > last &&
+                b->sequence < in_buf->sequence)
+                in_buf = b;
+        }
+        out->skipped += in_buf->sequence - last - 1;
+    }
+    if (in_buf)
+        in_buf->readers++;
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
+    return in_buf;
+}
+
+static void vcam_in_put(struct vcam_device *dev, struct vcam_in_buffer *in_buf)
+{
+    unsigned long flags = 0;
+
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    in_buf->readers--;
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
+}
+
+/* Id of the input frame a tick would show */
+static unsigned int vcam_current_input(struct vcam_device *dev)
+{
+    unsigned int input = VCAM_INPUT_PATTERN;
+    unsigned long flags = 0;
+
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    if (dev->fb_isopen && dev->in_queue.ready)
+        input = dev->in_queue.ready->sequence;
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
+    return input;
+}
+
+/* Whether capture buffers have exactly the layout of the input frame, so
+ * frames can be written straight into them. Only a device with a single
+ * capture node hands its buffers to the framebuffer writer.
+ */
+bool vcam_is_passthrough(struct vcam_device *dev)
+{
+    const struct v4l2_pix_format *fmt = &dev->outputs[0].output_format;
+
+    return dev->nr_outputs == 1 &&
+           fmt->pixelformat == dev->input_format.pixelformat &&
+           fmt->width == dev->input_format.width &&
+           fmt->height == dev->input_format.height &&
+           fmt->bytesperline == dev->input_format.bytesperline;
+}
+
+/* Deliver the frame the framebuffer writer completed in place. A frame that
+ * was written to the input queue because no capture buffer was free is
+ * copied instead. Nothing is delivered until a new frame arrives.
+ */
+static void submit_zero_copy(struct vcam_output *out)
+{
+    struct vcam_device *dev = out->dev;
+    struct vcam_in_queue *in_q = &dev->in_queue;
+    struct vcam_in_buffer *in_buf = NULL;
+    struct vcam_out_buffer *buf;
+    unsigned long flags = 0;
+
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    if (dev->zc_ready) {
+        buf = dev->zc_ready;
+        dev->zc_ready = NULL;
+        vcam_out_buffer_done(out, buf, VB2_BUF_STATE_DONE);
+    } else if (in_q->fresh && in_q->ready) {
+        buf = vcam_take_out_buffer(out);
+        if (buf) {
+            in_buf = in_q->ready;
+            in_buf->readers++;
+            in_q->fresh = false;
+        }
+    }
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
+
+    if (in_buf) {
+        enum vb2_buffer_state state = fill_copy_buffer(buf, in_buf, out);
+        vcam_in_put(dev, in_buf);
+        vcam_out_buffer_done(out, buf, state);
+    }
+}
+
+static bool vcam_zero_copy_active(struct vcam_device *dev)
+{
+    return dev->zero_copy_on && dev->fb_isopen && dev->zc_active &&
+           vcam_is_passthrough(dev);
+}
+
+/* Whether @out has a frame to deliver showing the input frame @input. In
+ * variable frame rate mode only a new input frame is.
+ */
+static bool vcam_frame_due(struct vcam_output *out, unsigned int input)
+{
+    return !out->dev->vfr_on || input != out->last_input ||
+           (input == VCAM_INPUT_PATTERN && vcam_pattern_due(out));
+}
+
+/* Fill @buf with the newest input frame, or the pattern without input.
+ * Returns false, leaving @buf untouched, if there is no input frame.
+ */
+static bool vcam_fill_buffer(struct vcam_output *out,
+                             struct vcam_out_buffer *buf,
+                             enum vb2_buffer_state *state)
+{
+    struct vcam_device *dev = out->dev;
+    struct vcam_in_buffer *in_buf;
+    u64 start;
+
+    if (!dev->fb_isopen) {
+        *state = fill_noinput_buffer(buf, out);
+        return true;
+    }
+
+    in_buf = vcam_in_get_next(out);
+    if (!in_buf) {
+        pr_err("Ready buffer in input queue has NULL pointer\n");
+        return false;
+    }
+    start = ktime_get_ns();
+    *state = fill_copy_buffer(buf, in_buf, out);
+    vcam_hist_record(dev->stats, VCAM_HIST_CONVERSION,
+                     ktime_get_ns() - start);
+    vcam_in_put(dev, in_buf);
+    if (dev->mem_node != NUMA_NO_NODE && numa_node_id() != dev->mem_node)
+        out->remote_frames++;
+    return true;
+}
+
+/* Fill the next queued buffer ahead of its deadline, so that delivering it
+ * is only a matter of completing it.
+ */
+static void vcam_prepare_frame(struct vcam_output *out)
+{
+    struct vcam_out_buffer *buf;
+
+    if (out->prepared || vcam_zero_copy_active(out->dev) ||
+        !vcam_frame_due(out, vcam_current_input(out->dev)))
+        return;
+
+    /* A missing buffer is accounted as a drop at the deadline */
+    buf = vcam_take_out_buffer(out);
+    if (!buf)
+        return;
+    if (vcam_fill_buffer(out, buf, &out->prepared_state))
+        out->prepared = buf;
+    else
+        vcam_requeue_out_buffer(out, buf);
+}
+
+static void vcam_deliver_frame(struct vcam_output *out)
+{
+    struct vcam_device *dev = out->dev;
+    struct vcam_out_buffer *buf = out->prepared;
+    enum vb2_buffer_state state;
+    unsigned int input;
+
+    if (buf) {
+        out->prepared = NULL;
+        vcam_out_buffer_done(out, buf, out->prepared_state);
+        return;
+    }
+
+    if (vcam_zero_copy_active(dev)) {
+        submit_zero_copy(out);
+        return;
+    }
+
+    input = vcam_current_input(dev);
+    if (!vcam_frame_due(out, input))
+        return;
+
+    buf = vcam_take_out_buffer(out);
+    if (!buf) {
+        pr_debug("Buffer queue is empty\n");
+        vcam_stat_inc(dev->stats, VCAM_STAT_EMPTY);
+        /* The frame due is dropped, leaving a gap in the sequence */
+        out->sequence++;
+        out->last_input = input;
+        return;
+    }
+
+    if (vcam_fill_buffer(out, buf, &state))
+        vcam_out_buffer_done(out, buf, state);
+    else
+        vcam_requeue_out_buffer(out, buf);
+}
+
+/* Account a frame that made its deadline, or finished @missed deadlines
+ * late, degrading the node after VCAM_OVERLOAD_ENTER late frames in a row
+ * and recovering it after VCAM_OVERLOAD_LEAVE frames on time.
+ */
+static void vcam_overload_update(struct vcam_output *out, u64 missed)
+{
+    struct vcam_overload *ol = &out->overload;
+
+    if (!missed) {
+        ol->late = 0;
+        if (ol->degraded && ++ol->on_time >= VCAM_OVERLOAD_LEAVE) {
+            pr_debug("%s recovered from overload\n",
+                     video_device_node_name(&out->vdev));
+            ol->degraded = false;
+        }
+        return;
+    }
+
+    ol->overruns++;
+    ol->dropped += missed;
+    vcam_stat_add(out->dev->stats, VCAM_STAT_DROPPED, missed);
+    ol->on_time = 0;
+    /* The frames due meanwhile leave a gap in the sequence */
+    if (!out->dev->vfr_on)
+        out->sequence += missed;
+    if (!ol->degraded && ++ol->late >= VCAM_OVERLOAD_ENTER) {
+        pr_debug("%s overloaded\n", video_device_node_name(&out->vdev));
+        ol->degraded = true;
+        ol->overloads++;
+    }
+}
+
+/* Sleep until the CLOCK_MONOTONIC time @deadline in ns, on a high
+ * resolution timer so frame intervals well below a jiffy hold.
+ */
+static void vcam_sleep_until(u64 deadline)
+{
+    ktime_t expires = ns_to_ktime(deadline);
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (kthread_should_stop()) {
+        __set_current_state(TASK_RUNNING);
+        return;
+    }
+    schedule_hrtimeout_range(&expires, VCAM_TIMER_SLACK_NS, HRTIMER_MODE_ABS);
+}
+
+/* Measure the frame rate achieved over windows of a second */
+static void vcam_fps_update(struct vcam_output *out, u64 now)
+{
+    u64 elapsed = now - out->fps_window_start;
+
+    if (elapsed < NSEC_PER_SEC)
+        return;
+    out->fps_achieved =
+        div64_u64((u64) out->fps_frames * NSEC_PER_SEC * 1000, elapsed);
+    out->fps_frames = 0;
+    out->fps_window_start = now;
+}
+
+int submitter_thread(void *data)
+{
+    struct vcam_output *out = (struct vcam_output *) data;
+    struct vcam_device *dev = out->dev;
+    u64 deadline = ktime_get_ns();
+
+    while (!kthread_should_stop()) {
+        u64 interval, now, lead;
+
+        down_read(&dev->reconf_lock);
+        vcam_deliver_frame(out);
+        up_read(&dev->reconf_lock);
+
+        if (!out->output_fps.numerator || !out->output_fps.denominator) {
+            out->output_fps.numerator = 1001;
+            out->output_fps.denominator = 30000;
+        }
+        interval = div_u64((u64) out->output_fps.numerator * NSEC_PER_SEC,
+                           out->output_fps.denominator);
+
+        /* A frame finished past the next deadline drops the frames due
+         * meanwhile, keeping the nominal rate.
+         */
+        deadline += interval;
+        now = ktime_get_ns();
+        if (now > deadline) {
+            u64 missed = div64_u64(now - deadline, interval) + 1;
+            vcam_overload_update(out, missed);
+            deadline += missed * interval;
+        } else {
+            vcam_overload_update(out, 0);
+        }
+        vcam_fps_update(out, now);
+
+        /* Convert the next frame early, leaving only its completion due */
+        lead = min(dev->preconvert_lead_ns, deadline - now);
+        if (lead) {
+            vcam_sleep_until(deadline - lead);
+            down_read(&dev->reconf_lock);
+            vcam_prepare_frame(out);
+            up_read(&dev->reconf_lock);
+        }
+        vcam_sleep_until(deadline);
+        now = ktime_get_ns();
+        vcam_hist_record(dev->stats, VCAM_HIST_LATENESS,
+                         now > deadline ? now - deadline : 0);
+    }
+
+    return 0;
+}
+
+static __u32 vcam_pixfmt_to_fourcc(pixfmt_t pix_fmt)
+{
+    switch (pix_fmt) {
     case VCAM_PIXFMT_YUYV:
-        fmt->pixelformat = V4L2_PIX_FMT_YUYV;
-        fmt->bytesperline = (fmt->width) << 1;
-        fmt->colorspace = V4L2_COLORSPACE_SMPTE170M;
+        return V4L2_PIX_FMT_YUYV;
+    case VCAM_PIXFMT_Y10:
+        return V4L2_PIX_FMT_Y10;
+    case VCAM_PIXFMT_P010:
+        return V4L2_PIX_FMT_P010;
+    case VCAM_PIXFMT_RGB24:
+    default:
+        return V4L2_PIX_FMT_RGB24;
+    }
+}
+
+/* Without pixel format conversion, only the input format is offered */
+static void set_passthrough_format(struct vcam_device *vcam, __u32 fourcc)
+{
+    int i;
+
+    vcam->out_fmts[0] = vcam_supported_fmts[0];
+    for (i = 0; i < ARRAY_SIZE(vcam_supported_fmts); i++) {
+        if (vcam_supported_fmts[i].fourcc == fourcc)
+            vcam->out_fmts[0] = vcam_supported_fmts[i];
+    }
+    vcam->nr_fmts = 1;
+}
+
+static void fill_v4l2pixfmt(struct v4l2_pix_format *fmt,
+                            struct vcam_device_spec *dev_spec)
+{
+    if (!fmt || !dev_spec)
+        return;
+
+    memset(fmt, 0x00, sizeof(struct v4l2_pix_format));
+    fmt->width = dev_spec->width;
+    fmt->height = dev_spec->height;
+    pr_debug("Filling %dx%d\n", dev_spec->width, dev_spec->height);
+
+    fmt->pixelformat = vcam_pixfmt_to_fourcc(dev_spec->pix_fmt);
+    fmt->field = V4L2_FIELD_NONE;
+    set_pix_format_size(fmt);
+}
+
+/* Requested and achieved frame rates of a node, in frames per second */
+static int vcam_fps_show(struct seq_file *s, void *unused)
+{
+    struct vcam_output *out = s->private;
+    struct v4l2_fract tpf = out->output_fps;
+    unsigned int achieved = out->fps_achieved;
+    u64 requested = 0;
+
+    if (tpf.numerator)
+        requested = div_u64((u64) tpf.denominator * 1000, tpf.numerator);
+
+    seq_printf(s, "requested: %llu.%03llu\n", requested / 1000,
+               requested % 1000);
+    seq_printf(s, "achieved: %u.%03u\n", achieved / 1000, achieved % 1000);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vcam_fps);
+
+static int vcam_output_init(struct vcam_device *vcam,
+                            unsigned int i,
+                            size_t idx)
+{
+    struct vcam_output *out = &vcam->outputs[i];
+    struct video_device *vdev = &out->vdev;
+    int ret;
+
+    out->dev = vcam;
+    out->idx = i;
+    mutex_init(&out->vcam_mutex);
+    spin_lock_init(&out->out_q_slock);
+    INIT_LIST_HEAD(&out->vcam_out_vidq.active);
+    out->output_format = vcam->input_format;
+    out->output_fps.numerator = 1001;
+    out->output_fps.denominator = 30000;
+    out->sub_thr_id = NULL;
+
+    /* Try to initialize output buffer */
+    ret = vcam_out_videobuf2_setup(out);
+    if (ret) {
+        pr_err(" failed to initialize output videobuffer\n");
+        return ret;
+    }
+
+    /* Setup controls */
+    out->jpeg_quality = VCAM_JPEG_QUALITY_DEFAULT;
+    out->test_pattern = VCAM_PATTERN_GRADIENT;
+    v4l2_ctrl_handler_init(&out->ctrl_handler, 6);
+    v4l2_ctrl_new_std(&out->ctrl_handler, &vcam_ctrl_ops,
+                      V4L2_CID_JPEG_COMPRESSION_QUALITY, 1, 100, 1,
+                      VCAM_JPEG_QUALITY_DEFAULT);
+    v4l2_ctrl_new_std_menu_items(&out->ctrl_handler, &vcam_ctrl_ops,
+                                 V4L2_CID_TEST_PATTERN,
+                                 ARRAY_SIZE(vcam_test_patterns) - 1, 0,
+                                 VCAM_PATTERN_GRADIENT, vcam_test_patterns);
+    v4l2_ctrl_new_custom(&out->ctrl_handler, &vcam_ctrl_delivery_times, NULL);
+    v4l2_ctrl_new_custom(&out->ctrl_handler, &vcam_ctrl_delivery_policy, NULL);
+    v4l2_ctrl_new_custom(&out->ctrl_handler, &vcam_ctrl_skipped_frames, NULL);
+    v4l2_ctrl_new_custom(&out->ctrl_handler, &vcam_ctrl_overload_strategy,
+                         NULL);
+    if (out->ctrl_handler.error) {
+        ret = out->ctrl_handler.error;
+        pr_err("failed to initialize controls\n");
+        goto ctrl_handler_failure;
+    }
+
+    *vdev = vcam_video_device_template;
+    vdev->v4l2_dev = &vcam->v4l2_dev;
+    vdev->queue = &out->vb_out_vidq;
+    vdev->lock = &out->vcam_mutex;
+    vdev->ctrl_handler = &out->ctrl_handler;
+    vdev->tvnorms = 0;
+    vdev->device_caps =
+        V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
+
+    if (vcam->nr_outputs > 1)
+        snprintf(vdev->name, sizeof(vdev->name), "%s-%d.%u", vcam_dev_name,
+                 (int) idx, i);
+    else
+        snprintf(vdev->name, sizeof(vdev->name), "%s-%d", vcam_dev_name,
+                 (int) idx);
+    video_set_drvdata(vdev, out);
+
+    ret = video_register_device(vdev, VFL_TYPE_VIDEO, -1);
+
+    if (ret < 0) {
+        pr_err("video_register_device failure\n");
+        goto ctrl_handler_failure;
+    }
+
+    out->debugfs = debugfs_create_dir(video_device_node_name(vdev),
+                                      vcam->debugfs);
+    debugfs_create_u64("skipped", 0444, out->debugfs, &out->skipped);
+    debugfs_create_u64("overruns", 0444, out->debugfs,
+                       &out->overload.overruns);
+    debugfs_create_u64("dropped", 0444, out->debugfs, &out->overload.dropped);
+    debugfs_create_u64("overloads", 0444, out->debugfs,
+                       &out->overload.overloads);
+    debugfs_create_file("fps", 0444, out->debugfs, out, &vcam_fps_fops);
+    debugfs_create_u64("remote_frames", 0444, out->debugfs,
+                       &out->remote_frames);
+
+    /* The DMA allocators map buffers against a struct device. The video
+     * node is not behind any bus, so give it a mask covering all memory.
+     */
+    if (vcam->mem_type != VCAM_MEMORY_MMAP) {
+        ret = dma_coerce_mask_and_coherent(&vdev->dev, DMA_BIT_MASK(64));
+        if (ret) {
+            pr_err("failed to set DMA mask\n");
+            goto dma_mask_failure;
+        }
+        out->vb_out_vidq.dev = &vdev->dev;
+    }
+
+    return 0;
+
+dma_mask_failure:
+    video_unregister_device(vdev);
+ctrl_handler_failure:
+    v4l2_ctrl_handler_free(&out->ctrl_handler);
+    return ret;
+}
+
+/* Throughput of a 1080p RGB24 frame scaled to 720p YUYV, which samples the
+ * input at strides of rows, with the input backed by 4 KiB pages and then
+ * by huge pages. Reads are serialized, so the frames held at once stay
+ * bounded however many readers there are.
+ */
+#define VCAM_BENCH_FRAMES 16
+
+static DEFINE_MUTEX(vcam_bench_lock);
+
+static u64 vcam_bench_run(void *dst,
+                          void *src,
+                          const struct v4l2_pix_format *in_fmt,
+                          const struct v4l2_pix_format *out_fmt)
+{
+    u64 start;
+    int i;
+
+    /* Warm the caches up the same way for both runs */
+    copy_scale_rgb24_to_yuyv(dst, src, in_fmt, out_fmt, 0, out_fmt->height);
+    start = ktime_get_ns();
+    for (i = 0; i < VCAM_BENCH_FRAMES; i++)
+        copy_scale_rgb24_to_yuyv(dst, src, in_fmt, out_fmt, 0,
+                                 out_fmt->height);
+    return max_t(u64, ktime_get_ns() - start, 1);
+}
+
+static void vcam_bench_report(struct seq_file *s, const char *name, u64 ns)
+{
+    u64 rate = div64_u64((u64) VCAM_BENCH_FRAMES * NSEC_PER_SEC * 1000, ns);
+
+    seq_printf(s, "%s: %llu.%03llu frames/s\n", name, rate / 1000,
+               rate % 1000);
+}
+
+static int vcam_bench_show(struct seq_file *s, void *unused)
+{
+    struct v4l2_pix_format in_fmt = {
+        .width = 1920,
+        .height = 1080,
+        .pixelformat = V4L2_PIX_FMT_RGB24,
+    };
+    struct v4l2_pix_format out_fmt = {
+        .width = 1280,
+        .height = 720,
+        .pixelformat = V4L2_PIX_FMT_YUYV,
+    };
+    void *src, *dst;
+    u64 small;
+
+    set_pix_format_size(&in_fmt);
+    set_pix_format_size(&out_fmt);
+    mutex_lock(&vcam_bench_lock);
+    dst = vmalloc(out_fmt.sizeimage);
+    src = vzalloc(in_fmt.sizeimage);
+    if (!dst || !src) {
+        vfree(src);
+        vfree(dst);
+        mutex_unlock(&vcam_bench_lock);
+        return -ENOMEM;
+    }
+    small = vcam_bench_run(dst, src, &in_fmt, &out_fmt);
+    vfree(src);
+    vcam_bench_report(s, "4k pages", small);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    /* vmalloc_huge() falls back to 4 KiB pages when it finds no huge one */
+    src = vmalloc_huge(in_fmt.sizeimage, GFP_KERNEL | __GFP_ZERO);
+    if (!src) {
+        seq_puts(s, "huge pages: allocation failed\n");
+    } else if (!is_vm_area_hugepages(src)) {
+        seq_puts(s, "huge pages: none available, fell back to 4k pages\n");
+    } else {
+        u64 huge = vcam_bench_run(dst, src, &in_fmt, &out_fmt);
+        u64 speedup = div64_u64(small * 100, huge);
+
+        vcam_bench_report(s, "huge pages", huge);
+        seq_printf(s, "speedup: %llu.%02llux\n", speedup / 100,
+                   speedup % 100);
+    }
+    vfree(src);
+#else
+    seq_puts(s, "huge pages: not supported by this kernel\n");
+#endif
+    vfree(dst);
+    mutex_unlock(&vcam_bench_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vcam_bench);
+
+void vcam_bench_init(void)
+{
+    debugfs_create_file("bench", 0444, vcam_debugfs_root, NULL,
+                        &vcam_bench_fops);
+}
+
+static void vcam_output_release(struct vcam_output *out)
+{
+    v4l2_ctrl_handler_free(&out->ctrl_handler);
+    mutex_destroy(&out->vcam_mutex);
+}
+
+/* A capture node left open reaches its device through the drvdata of the
+ * video device, which the V4L2 core keeps until the node is closed. Each
+ * registered video device holds a reference on the v4l2_device, so the
+ * device is freed here once the last of them is released.
+ */
+static void vcam_v4l2_release(struct v4l2_device *v4l2_dev)
+{
+    struct vcam_device *vcam =
+        container_of(v4l2_dev, struct vcam_device, v4l2_dev);
+    int i;
+
+    for (i = 0; i < vcam->nr_outputs; i++)
+        vcam_output_release(&vcam->outputs[i]);
+    mutex_destroy(&vcam->caches_mutex);
+    vcam_stats_destroy(vcam);
+    kfree(vcam);
+}
+
+/* The NUMA node @config binds the device to, or NUMA_NO_NODE to follow
+ * the producer. A node that is not online is not bound to.
+ */
+static int vcam_config_node(struct vcam_device_config *config)
+{
+    int node = (int) config->numa_node - 1;
+
+    if (config->numa_node && config->numa_node <= MAX_NUMNODES &&
+        node_online(node))
+        return node;
+    config->numa_node = 0;
+    return NUMA_NO_NODE;
+}
+
+/* Without a second node there is nothing to place, and frame memory stays
+ * free to use huge pages.
+ */
+int vcam_device_node(struct vcam_device *vcam)
+{
+    int node = READ_ONCE(vcam->numa_node);
+
+    if (num_online_nodes() < 2)
+        return NUMA_NO_NODE;
+    return node != NUMA_NO_NODE ? node : READ_ONCE(vcam->producer_node);
+}
+
+/* Normalize the scheduling settings of @config */
+static void vcam_config_sched(struct vcam_device_config *config)
+{
+    switch (config->sched_policy) {
+    case VCAM_SCHED_FIFO:
+        if (!config->sched_priority)
+            config->sched_priority = MAX_RT_PRIO / 2;
+        else if (config->sched_priority > MAX_RT_PRIO - 1)
+            config->sched_priority = MAX_RT_PRIO - 1;
+        break;
+    case VCAM_SCHED_DEADLINE:
         break;
     default:
-        fmt->pixelformat = V4L2_PIX_FMT_RGB24;
-        fmt->bytesperline = (fmt->width * 3);
-        fmt->colorspace = V4L2_COLORSPACE_SRGB;
+        config->sched_policy = VCAM_SCHED_NORMAL;
         break;
     }
+    config->cpus[sizeof(config->cpus) - 1] = '\0';
+}
 
-    fmt->field = V4L2_FIELD_NONE;
-    fmt->sizeimage = fmt->height * fmt->bytesperline;
+/* Take the CPUs listed in @config for the submitters, or all of them for an
+ * empty list or one without any CPU online.
+ */
+static void vcam_set_cpus(struct vcam_device *vcam,
+                          struct vcam_device_config *config)
+{
+    if (config->cpus[0] &&
+        (cpulist_parse(config->cpus, &vcam->cpus) ||
+         !cpumask_intersects(&vcam->cpus, cpu_online_mask))) {
+        pr_err("Invalid CPU list %s\n", config->cpus);
+        config->cpus[0] = '\0';
+    }
+    if (!config->cpus[0])
+        cpumask_copy(&vcam->cpus, cpu_possible_mask);
+}
+
+/* Let the submitter of @out run on the CPUs set for its device, those of the
+ * device's node among them if any, and give it the scheduling policy of the
+ * device. A deadline period is the frame interval of the node. Called with
+ * the vcam_mutex of @out held.
+ */
+void vcam_place_submitter(struct vcam_output *out)
+{
+    struct vcam_device *dev = out->dev;
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = SCHED_NORMAL,
+    };
+    int ret, node = vcam_device_node(dev);
+    u64 interval;
+
+    down_read(&dev->reconf_lock);
+    cpumask_copy(&out->sub_cpus, &dev->cpus);
+    if (node != NUMA_NO_NODE &&
+        cpumask_intersects(&dev->cpus, cpumask_of_node(node)))
+        cpumask_and(&out->sub_cpus, &dev->cpus, cpumask_of_node(node));
+
+    switch (dev->config.sched_policy) {
+    case VCAM_SCHED_FIFO:
+        attr.sched_policy = SCHED_FIFO;
+        attr.sched_priority = dev->config.sched_priority;
+        break;
+    case VCAM_SCHED_DEADLINE:
+        interval = div_u64((u64) out->output_fps.numerator * NSEC_PER_SEC,
+                           out->output_fps.denominator);
+        attr.sched_policy = SCHED_DEADLINE;
+        attr.sched_period = interval;
+        attr.sched_deadline = interval;
+        attr.sched_runtime = interval >> 2;
+        if (dev->config.sched_runtime_us)
+            attr.sched_runtime =
+                min_t(u64, interval,
+                      (u64) dev->config.sched_runtime_us * NSEC_PER_USEC);
+        /* A deadline task must be allowed every CPU of its root domain */
+        cpumask_copy(&out->sub_cpus, cpu_possible_mask);
+        break;
+    default:
+        break;
+    }
+    up_read(&dev->reconf_lock);
+
+    /* The affinity is widened before entering the deadline class, and
+     * narrowed after leaving it.
+     */
+    if (attr.sched_policy == SCHED_DEADLINE)
+        set_cpus_allowed_ptr(out->sub_thr_id, &out->sub_cpus);
+    ret = sched_setattr_nocheck(out->sub_thr_id, &attr);
+    if (ret)
+        pr_err("Failed to set the scheduling policy of %s: %d\n",
+               out->sub_thr_id->comm, ret);
+    if (attr.sched_policy != SCHED_DEADLINE)
+        set_cpus_allowed_ptr(out->sub_thr_id, &out->sub_cpus);
+}
+
+/* Apply the placement and scheduling of the device to the submitters
+ * streaming already
+ */
+void vcam_place_submitters(struct vcam_device *vcam)
+{
+    int i;
+
+    for (i = 0; i < vcam->nr_outputs; i++) {
+        struct vcam_output *out = &vcam->outputs[i];
+
+        mutex_lock(&out->vcam_mutex);
+        if (out->sub_thr_id)
+            vcam_place_submitter(out);
+        mutex_unlock(&out->vcam_mutex);
+    }
 }
 
 struct vcam_device *create_vcam_device(size_t idx,
-                                       struct vcam_device_spec *dev_spec)
+                                       struct vcam_device_config *config)
 {
-    struct video_device *vdev;
+    struct vcam_device_spec *dev_spec = &config->spec;
     int i, ret = 0;
 
     struct vcam_device *vcam =
         (struct vcam_device *) kzalloc(sizeof(struct vcam_device), GFP_KERNEL);
     if (!vcam)
         goto vcam_alloc_failure;
+    kref_init(&vcam->refcount);
+    vcam->idx = idx;
 
     /* Register V4L2 device */
     snprintf(vcam->v4l2_dev.name, sizeof(vcam->v4l2_dev.name), "%s-%d",
@@ -770,46 +2339,50 @@ struct vcam_device *create_vcam_device(size_t idx,
         pr_err("v4l2 registration failure\n");
         goto v4l2_registration_failure;
     }
+    vcam->v4l2_dev.release = vcam_v4l2_release;
 
-    /* Initialize buffer queue and device structures */
-    mutex_init(&vcam->vcam_mutex);
-
-    /* Try to initialize output buffer */
-    ret = vcam_out_videobuf2_setup(vcam);
+    vcam->debugfs = debugfs_create_dir(vcam->v4l2_dev.name, vcam_debugfs_root);
+    debugfs_create_u64("remote_writes", 0444, vcam->debugfs,
+                       &vcam->remote_writes);
+    ret = vcam_stats_init(vcam);
     if (ret) {
-        pr_err(" failed to initialize output videobuffer\n");
-        goto vb2_out_init_failed;
+        pr_err("Failed to allocate counters\n");
+        goto stats_failure;
     }
 
-    spin_lock_init(&vcam->out_q_slock);
+    /* Initialize buffer queue and device structures */
+    mutex_init(&vcam->caches_mutex);
+    mutex_init(&vcam->zc_mutex);
+    init_rwsem(&vcam->reconf_lock);
+    for (i = 0; i < VCAM_OUTPUTS_MAX; i++)
+        mutex_init(&vcam->caches[i].lock);
+
     spin_lock_init(&vcam->in_q_slock);
     spin_lock_init(&vcam->in_fh_slock);
 
-    INIT_LIST_HEAD(&vcam->vcam_out_vidq.active);
-
-    vdev = &vcam->vdev;
-    *vdev = vcam_video_device_template;
-    vdev->v4l2_dev = &vcam->v4l2_dev;
-    vdev->queue = &vcam->vb_out_vidq;
-    vdev->lock = &vcam->vcam_mutex;
-    vdev->tvnorms = 0;
-    vdev->device_caps =
-        V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
-
-    snprintf(vdev->name, sizeof(vdev->name), "%s-%d", vcam_dev_name, (int) idx);
-    video_set_drvdata(vdev, vcam);
-
-    ret = video_register_device(vdev, VFL_TYPE_VIDEO, -1);
-
-    if (ret < 0) {
-        pr_err("video_register_device failure\n");
-        goto video_regdev_failure;
+    switch (dev_spec->mem_type) {
+    case VCAM_MEMORY_DMABUF:
+    case VCAM_MEMORY_DMABUF_SG:
+        vcam->mem_type = dev_spec->mem_type;
+        break;
+    default:
+        vcam->mem_type = VCAM_MEMORY_MMAP;
+        break;
     }
+    dev_spec->mem_type = vcam->mem_type;
 
     /* Setup conversion capabilities */
     vcam->conv_res_on = (bool) allow_scaling;
     vcam->conv_pixfmt_on = (bool) allow_pix_conversion;
     vcam->conv_crop_on = (bool) allow_cropping;
+    vcam->zero_copy_on = (bool) allow_zero_copy;
+    vcam->vfr_on = (bool) allow_vfr;
+    vcam->write_compare_on = (bool) compare_writes;
+    vcam->preconvert_lead_ns = (u64) preconvert_lead_us * NSEC_PER_USEC;
+    vcam->idle_release_ms = idle_release_ms;
+    vcam->numa_node = vcam_config_node(config);
+    vcam->producer_node = NUMA_NO_NODE;
+    vcam->mem_node = NUMA_NO_NODE;
 
     /* Alloc and set initial format */
     if (vcam->conv_pixfmt_on) {
@@ -817,11 +2390,7 @@ struct vcam_device *create_vcam_device(size_t idx,
             vcam->out_fmts[i] = vcam_supported_fmts[i];
         vcam->nr_fmts = i;
     } else {
-        if (dev_spec && dev_spec->pix_fmt == VCAM_PIXFMT_YUYV)
-            vcam->out_fmts[0] = vcam_supported_fmts[1];
-        else
-            vcam->out_fmts[0] = vcam_supported_fmts[0];
-        vcam->nr_fmts = 1;
+        set_passthrough_format(vcam, vcam_pixfmt_to_fourcc(dev_spec->pix_fmt));
     }
 
     if (vcam->conv_res_on) {
@@ -841,12 +2410,27 @@ struct vcam_device *create_vcam_device(size_t idx,
         dev_spec->cropratio.numerator = 1;
         dev_spec->cropratio.denominator = 1;
     }
-    vcam->fb_spec = *dev_spec;
 
-    fill_v4l2pixfmt(&vcam->output_format, dev_spec);
+    if (!config->nr_outputs)
+        config->nr_outputs = 1;
+    else if (config->nr_outputs > VCAM_OUTPUTS_MAX)
+        config->nr_outputs = VCAM_OUTPUTS_MAX;
+    vcam->nr_outputs = config->nr_outputs;
+    vcam->in_queue.nr_buffers = vcam->nr_outputs + 3;
+
+    vcam_config_sched(config);
+    vcam_set_cpus(vcam, config);
+
+    vcam->config = *config;
+
     fill_v4l2pixfmt(&vcam->input_format, dev_spec);
 
-    vcam->sub_thr_id = NULL;
+    /* Register the capture nodes */
+    for (i = 0; i < vcam->nr_outputs; i++) {
+        ret = vcam_output_init(vcam, i, idx);
+        if (ret)
+            goto output_init_failure;
+    }
 
     /* Initialize framebuffer */
     ret = vcamfb_init(vcam);
@@ -856,36 +2440,62 @@ struct vcam_device *create_vcam_device(size_t idx,
     }
     vcam->fb_isopen = 0;
 
-    vcam->output_fps.numerator = 1001;
-    vcam->output_fps.denominator = 30000;
-
     return vcam;
 
 vcamfb_failure:
     vcamfb_destroy(vcam);
-video_regdev_failure:
-    video_unregister_device(&vcam->vdev);
-    video_device_release(&vcam->vdev);
-vb2_out_init_failed:
+output_init_failure:
+    while (i--)
+        video_unregister_device(&vcam->outputs[i].vdev);
+stats_failure:
+    debugfs_remove_recursive(vcam->debugfs);
     v4l2_device_unregister(&vcam->v4l2_dev);
+    v4l2_device_put(&vcam->v4l2_dev);
+    return NULL;
 v4l2_registration_failure:
     kfree(vcam);
 vcam_alloc_failure:
     return NULL;
 }
 
-int modify_vcam_device(struct vcam_device *vcam,
-                       struct vcam_device_spec *dev_spec)
+/* Tell the consumers of the capture nodes that the input format changed. A
+ * node without buffers takes the new format at once; a streaming one keeps
+ * its format, scaling the new input to it, until its consumer renegotiates.
+ */
+static void vcam_source_changed(struct vcam_device *vcam)
 {
-    unsigned long flags = 0;
+    const struct v4l2_event ev = {
+        .type = V4L2_EVENT_SOURCE_CHANGE,
+        .u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION,
+    };
+    int i;
 
-    spin_lock_irqsave(&vcam->in_fh_slock, flags);
-    if (vcam->fb_isopen) {
-        spin_unlock_irqrestore(&vcam->in_fh_slock, flags);
-        return -EBUSY;
+    for (i = 0; i < vcam->nr_outputs; i++) {
+        struct vcam_output *out = &vcam->outputs[i];
+
+        mutex_lock(&out->vcam_mutex);
+        if (vb2_is_busy(&out->vb_out_vidq)) {
+            out->source_changed = true;
+        } else {
+            out->output_format = vcam->input_format;
+            out->source_changed = false;
+        }
+        mutex_unlock(&out->vcam_mutex);
+        v4l2_event_queue(&out->vdev, &ev);
     }
-    vcam->fb_isopen = true;
-    spin_unlock_irqrestore(&vcam->in_fh_slock, flags);
+}
+
+/* Reconfigure the input, also while it is written and streamed. The memory
+ * for the new format is allocated beside the current one, and the switch
+ * waits for the frames being written or converted to complete.
+ */
+int modify_vcam_device(struct vcam_device *vcam,
+                       struct vcam_device_config *config)
+{
+    struct vcam_device_spec *dev_spec = &config->spec;
+    struct v4l2_pix_format format;
+    int numa_node, node;
+    void *addr;
 
     dev_spec->xres_virtual = dev_spec->width;
     dev_spec->yres_virtual = dev_spec->height;
@@ -897,14 +2507,41 @@ int modify_vcam_device(struct vcam_device *vcam,
         dev_spec->cropratio.numerator = 1;
         dev_spec->cropratio.denominator = 1;
     }
-    vcam->fb_spec = *dev_spec;
-    fill_v4l2pixfmt(&vcam->input_format, dev_spec);
-    vcamfb_update(vcam);
-    vcam->output_format = vcam->input_format;
+    /* The number of capture nodes is fixed at creation */
+    config->nr_outputs = vcam->nr_outputs;
+    fill_v4l2pixfmt(&format, dev_spec);
+    vcam_config_sched(config);
+    numa_node = vcam_config_node(config);
+    if (num_online_nodes() < 2)
+        node = NUMA_NO_NODE;
+    else if (numa_node != NUMA_NO_NODE)
+        node = numa_node;
+    else
+        node = vcam->producer_node;
+
+    addr = vcamfb_alloc(vcam, &format, node);
+    if (!addr)
+        return -ENOMEM;
 
-    spin_lock_irqsave(&vcam->in_fh_slock, flags);
-    vcam->fb_isopen = false;
-    spin_unlock_irqrestore(&vcam->in_fh_slock, flags);
+    down_write(&vcam->reconf_lock);
+    /* A producer mapping the framebuffer would keep the old memory */
+    if (vcam->fb_mapped) {
+        up_write(&vcam->reconf_lock);
+        vcam_pool_free(addr);
+        return -EBUSY;
+    }
+    vcam_set_cpus(vcam, config);
+    vcam->config = *config;
+    vcam->input_format = format;
+    WRITE_ONCE(vcam->numa_node, numa_node);
+    addr = vcamfb_update(vcam, addr);
+    if (!vcam->conv_pixfmt_on)
+        set_passthrough_format(vcam, vcam->input_format.pixelformat);
+    up_write(&vcam->reconf_lock);
+
+    vcam_pool_free(addr);
+    vcam_place_submitters(vcam);
+    vcam_source_changed(vcam);
 
     pr_debug("Input format set (%dx%d)(%dx%d)\n", dev_spec->xres_virtual,
              dev_spec->yres_virtual, dev_spec->width, dev_spec->height);
@@ -914,15 +2551,21 @@ int modify_vcam_device(struct vcam_device *vcam,
 
 void destroy_vcam_device(struct vcam_device *vcam)
 {
+    int i;
+
     if (!vcam)
         return;
 
-    if (vcam->sub_thr_id)
-        kthread_stop(vcam->sub_thr_id);
+    for (i = 0; i < vcam->nr_outputs; i++) {
+        if (vcam->outputs[i].sub_thr_id)
+            kthread_stop(vcam->outputs[i].sub_thr_id);
+    }
+    debugfs_remove_recursive(vcam->debugfs);
     vcamfb_destroy(vcam);
-    mutex_destroy(&vcam->vcam_mutex);
-    video_unregister_device(&vcam->vdev);
+    for (i = 0; i < vcam->nr_outputs; i++)
+        video_unregister_device(&vcam->outputs[i].vdev);
     v4l2_device_unregister(&vcam->v4l2_dev);
 
-    kfree(vcam);
+    /* Freed by vcam_v4l2_release() once no capture node is open */
+    v4l2_device_put(&vcam->v4l2_dev);
 }
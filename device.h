@@ -1,17 +1,22 @@
 #ifndef VCAM_DEVICE_H
 #define VCAM_DEVICE_H
 
+#include <linux/bitmap.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
 #include <linux/version.h>
 #include <media/v4l2-common.h>
+#include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-rect.h>
 #include <media/videobuf2-core.h>
 #include <media/videobuf2-v4l2.h>
 
+#include "stats.h"
 #include "vcam.h"
 
-#define PIXFMTS_MAX 4
+#define PIXFMTS_MAX 16
 #define FB_NAME_MAXLENGTH 16
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0)
@@ -20,24 +25,60 @@
 #define HD_720_HEIGHT 720
 #endif
 
+/* Enough input buffers for the writer, the newest complete frame, the frame
+ * drawn through a mapping of the framebuffer and one frame being converted
+ * by each capture node.
+ */
+#define VCAM_IN_BUFFERS_MAX (VCAM_OUTPUTS_MAX + 3)
+
+/* Input rows are tracked for changes in stripes of VCAM_STRIPE_ROWS rows.
+ * Rows past the last stripe share it.
+ */
+#define VCAM_STRIPE_ROWS 16
+#define VCAM_STRIPES_MAX 256
+
+static inline unsigned int vcam_stripe_of(size_t row)
+{
+    return min_t(size_t, row / VCAM_STRIPE_ROWS, VCAM_STRIPES_MAX - 1);
+}
+
 struct vcam_in_buffer {
     void *data;
     size_t filled;
     size_t xbar, ybar;
     uint32_t jiffies;
+    /* Input frame number, and how many capture nodes are converting it */
+    unsigned int sequence;
+    unsigned int readers;
+    /* CLOCK_MONOTONIC capture time in ns */
+    u64 timestamp;
+    /* Stripes that differ from the input frame numbered base_sequence */
+    unsigned int base_sequence;
+    DECLARE_BITMAP(dirty, VCAM_STRIPES_MAX);
 };
 
 struct vcam_in_queue {
-    struct vcam_in_buffer buffers[2];
+    struct vcam_in_buffer buffers[VCAM_IN_BUFFERS_MAX];
+    unsigned int nr_buffers;
     struct vcam_in_buffer dummy;
     struct vcam_in_buffer *pending;
     struct vcam_in_buffer *ready;
+    unsigned int sequence;
+    /* Capture time the producer gave for the next frame, 0 if none */
+    u64 next_timestamp;
+    /* Set when ready holds a frame not delivered yet in zero-copy mode */
+    bool fresh;
 };
 
 struct vcam_out_buffer {
     struct vb2_v4l2_buffer vb;
     struct list_head list;
     size_t filled;
+    /* Input frame shown and its capture time, 0 if unknown */
+    unsigned int input_sequence;
+    u64 input_timestamp;
+    /* The test pattern shown was drawn anew rather than repeated */
+    bool pattern_changed;
 };
 
 struct vcam_out_queue {
@@ -46,47 +87,255 @@ struct vcam_out_queue {
     /* TODO: implement more */
 };
 
+/* Input frame id of the no-input pattern, and of no frame at all */
+#define VCAM_INPUT_PATTERN 0
+#define VCAM_INPUT_NONE UINT_MAX
+
+/* Read-only array of the delivery times of the buffers of a capture node,
+ * indexed by buffer index: the CLOCK_MONOTONIC time in nanoseconds at which
+ * the buffer was last completed. The buffer timestamps carry the capture
+ * time of the input frame shown instead. Element i only belongs to the frame
+ * in buffer i from the DQBUF of the buffer to its next QBUF; once queued,
+ * the buffer can be completed again and the element overwritten at any time.
+ * The queues hold at most VB2_MAX_FRAME buffers, one per element.
+ */
+#define VCAM_CID_DELIVERY_TIMES (V4L2_CID_USER_BASE | 0xf000)
+
+/* Driver control selecting which input frame a capture node converts next:
+ * the newest one, or the oldest one not delivered yet so every frame is
+ * shown in order while the input queue holds it.
+ */
+#define VCAM_CID_DELIVERY_POLICY (V4L2_CID_USER_BASE | 0xf001)
+
+enum vcam_delivery_policy {
+    VCAM_DELIVERY_MAILBOX,
+    VCAM_DELIVERY_FIFO,
+};
+
+/* Read-only count of the input frames a node passed over while streaming */
+#define VCAM_CID_SKIPPED_FRAMES (V4L2_CID_USER_BASE | 0xf002)
+
+/* Driver control selecting how a capture node degrades while it cannot
+ * keep up with its frame rate. Missed frames are always dropped, keeping
+ * the nominal rate; the node can in addition convert only every other row
+ * of uncompressed formats, or lower the MJPEG quality.
+ */
+#define VCAM_CID_OVERLOAD_STRATEGY (V4L2_CID_USER_BASE | 0xf003)
+
+enum vcam_overload_strategy {
+    VCAM_OVERLOAD_DROP,
+    VCAM_OVERLOAD_FAST_SCALER,
+    VCAM_OVERLOAD_LOW_QUALITY,
+};
+
+/* Late frames in a row degrading a node, and frames on time in a row
+ * recovering it.
+ */
+#define VCAM_OVERLOAD_ENTER 2
+#define VCAM_OVERLOAD_LEAVE 60
+
+/* Highest frame rate offered, and how late the frame timer may fire */
+#define VCAM_FPS_MAX 240
+#define VCAM_TIMER_SLACK_NS 50000
+
+struct vcam_overload {
+    int strategy;
+    bool degraded;
+    unsigned int late, on_time;
+    /* Frames finished past their deadline, deadlines missed entirely, and
+     * times the node degraded.
+     */
+    u64 overruns;
+    u64 dropped;
+    u64 overloads;
+};
+
 struct vcam_device_format {
     char *name;
     int fourcc;
     int bit_depth;
 };
 
+/* The last converted frame of one output format, keyed by the input frame
+ * sequence. It is shared by the capture nodes streaming that format, so each
+ * input frame is converted only once, and repeated ticks on the same input
+ * frame are a copy instead of a conversion.
+ */
+struct vcam_conv_cache {
+    struct mutex lock;
+    struct v4l2_pix_format format;
+    int jpeg_quality;
+    void *data;
+    size_t payload;
+    unsigned int sequence;
+    bool valid;
+    /* Only every other row was converted */
+    bool halved;
+    /* Streaming capture nodes attached to this entry */
+    unsigned int users;
+};
+
+enum vcam_test_pattern {
+    VCAM_PATTERN_GRADIENT,
+    VCAM_PATTERN_COLOR_BARS,
+    VCAM_PATTERN_MOVING_BOX,
+    VCAM_PATTERN_FRAME_COUNTER,
+};
+
+/* The no-input pattern of a capture node, allocated while streaming. frame
+ * holds the still part of pattern id, -1 if none is drawn yet, in the output
+ * format or YUYV for MJPEG, and jpeg the compressed frame of a still pattern.
+ */
+struct vcam_pattern {
+    int id;
+    void *frame;
+    void *jpeg;
+    size_t jpeg_size;
+    int jpeg_quality;
+};
+
+struct vcam_device;
+
+/* A capture node. Each one has its own format, frame rate and submitter
+ * thread, and all of them read from the input queue of their device.
+ */
+struct vcam_output {
+    struct vcam_device *dev;
+    unsigned int idx;
+    struct video_device vdev;
+    struct mutex vcam_mutex;
+
+    /* output buffer */
+    struct vb2_queue vb_out_vidq;
+    struct vcam_out_queue vcam_out_vidq;
+    spinlock_t out_q_slock;
+    /* Output framerate */
+    struct v4l2_fract output_fps;
+    struct v4l2_pix_format output_format;
+    /* The input format changed while the node had buffers, so its format
+     * follows once they are released.
+     */
+    bool source_changed;
+
+    /* Submitter thread, and the CPUs it is allowed */
+    struct task_struct *sub_thr_id;
+    struct cpumask sub_cpus;
+
+    /* Number of the next frame, counting the dropped ones, and the input
+     * frame delivered last, VCAM_INPUT_NONE before the first one.
+     */
+    unsigned int sequence;
+    unsigned int last_input;
+
+    /* Buffer filled ahead of its deadline and its completion state */
+    struct vcam_out_buffer *prepared;
+    enum vb2_buffer_state prepared_state;
+
+    /* Input frames never converted since streaming started */
+    u64 skipped;
+
+    struct vcam_overload overload;
+    struct dentry *debugfs;
+
+    /* Frames delivered in the current window of a second, and the frame
+     * rate achieved over the last one, in thousandths of a frame.
+     */
+    u64 fps_window_start;
+    unsigned int fps_frames;
+    unsigned int fps_achieved;
+
+    /* Frames converted on a CPU of another node than the input memory */
+    u64 remote_frames;
+
+    /* Conversion cache entry while streaming */
+    struct vcam_conv_cache *cache;
+
+    /* Controls */
+    struct v4l2_ctrl_handler ctrl_handler;
+    int jpeg_quality;
+    int test_pattern;
+    int delivery_policy;
+    /* Time each buffer was last completed, see VCAM_CID_DELIVERY_TIMES.
+     * Written by the submitter when completing the buffer, so it is only
+     * stable while the buffer is dequeued.
+     */
+    u64 delivery_time[VB2_MAX_FRAME];
+
+    struct vcam_pattern pattern;
+
+    /* MJPEG encoder state and the scratch frame used to render the no-input
+     * pattern before it is compressed; allocated while streaming MJPEG.
+     */
+    struct vcam_jpeg_enc *jpeg_enc;
+    void *jpeg_scratch;
+};
+
 struct vcam_device {
     dev_t dev_number;
     struct v4l2_device v4l2_dev;
-    struct video_device vdev;
+
+    /* Held by the device registry and by control requests using it. The
+     * last put unregisters the device; its memory stays until the open
+     * capture nodes are closed, see the v4l2_device release.
+     */
+    struct kref refcount;
+    /* Index in the device registry */
+    unsigned int idx;
+
+    struct dentry *debugfs;
+
+    /* Capture nodes */
+    struct vcam_output outputs[VCAM_OUTPUTS_MAX];
+    unsigned int nr_outputs;
+
+    /* Held for reading while the input is written or converted, and for
+     * writing while the input format is switched.
+     */
+    struct rw_semaphore reconf_lock;
 
     /* input buffer */
     struct vcam_in_queue in_queue;
     spinlock_t in_q_slock;
     spinlock_t in_fh_slock;
+    /* A producer or the removal of the device holds the framebuffer, and
+     * the producer has its frame memory in place. The latter is only set
+     * with reconf_lock held for writing.
+     */
+    bool fb_claimed;
     bool fb_isopen;
 
-    /* output buffer */
-    struct vb2_queue vb_out_vidq;
-    struct vcam_out_queue vcam_out_vidq;
-    spinlock_t out_q_slock;
-    /* Output framerate */
-    struct v4l2_fract output_fps;
+    /* Converted frames shared between capture nodes */
+    struct vcam_conv_cache caches[VCAM_OUTPUTS_MAX];
+    struct mutex caches_mutex;
 
     /* Input framebuffer */
     char vcam_fb_fname[FB_NAME_MAXLENGTH];
     struct proc_dir_entry *vcam_fb_procf;
-    struct mutex vcam_mutex;
 
     /* framebuffer private data */
     void *fb_priv;
+    /* The framebuffer is mapped, so the input may change without a write */
+    bool fb_mapped;
+    /* The mapping producer reports what it draws with VCAMFB_IOCTL_DAMAGE */
+    bool fb_damage;
 
-    /* Submitter thread */
-    struct task_struct *sub_thr_id;
+    /* Zero-copy passthrough on a device with a single capture node: the
+     * capture buffer being filled in place by the framebuffer writer, and the
+     * last completed one awaiting delivery. zc_mutex serializes the writer
+     * against stop_streaming. zc_active is set once a frame went this way
+     * since the framebuffer was opened, so producers that only mmap the
+     * framebuffer keep the copying path.
+     */
+    struct mutex zc_mutex;
+    struct vcam_out_buffer *zc_buf;
+    struct vcam_out_buffer *zc_ready;
+    bool zc_active;
 
     /* Format descriptor */
     size_t nr_fmts;
     struct vcam_device_format out_fmts[PIXFMTS_MAX];
 
-    struct vcam_device_spec fb_spec;
-    struct v4l2_pix_format output_format;
+    struct vcam_device_config config;
     struct v4l2_pix_format input_format;
 
     /* Memory type */
@@ -96,14 +345,53 @@ struct vcam_device {
     bool conv_pixfmt_on;
     bool conv_res_on;
     bool conv_crop_on;
+    bool zero_copy_on;
+    bool vfr_on;
+    /* Compare frames written with the previous one to find changed stripes */
+    bool write_compare_on;
+
+    /* How long before its deadline a frame is converted, 0 for at it */
+    u64 preconvert_lead_ns;
+
+    /* How long the frame memory outlives the closing of the framebuffer,
+     * 0 to keep it
+     */
+    unsigned int idle_release_ms;
+
+    /* NUMA node set for the device, NUMA_NO_NODE to follow the producer, and
+     * the node of the CPU the producer last opened the framebuffer on. The
+     * frame memory and the submitters are placed on vcam_device_node().
+     */
+    int numa_node;
+    int producer_node;
+    /* Node the input frame memory was allocated on */
+    int mem_node;
+    /* CPUs set for the submitters, all possible ones if none */
+    struct cpumask cpus;
+    /* Writes and damage reports of the producer from a CPU of another node
+     * than the input memory
+     */
+    u64 remote_writes;
+
+    /* Hot path counters and latency histograms, one set per CPU */
+    struct vcam_stats __percpu *stats;
 };
 
 struct vcam_device *create_vcam_device(size_t idx,
-                                       struct vcam_device_spec *dev_spec);
+                                       struct vcam_device_config *config);
 int modify_vcam_device(struct vcam_device *vcam,
-                       struct vcam_device_spec *dev_spec);
+                       struct vcam_device_config *config);
 void destroy_vcam_device(struct vcam_device *vcam);
 
+int vcam_device_node(struct vcam_device *vcam);
+void vcam_place_submitter(struct vcam_output *out);
+void vcam_place_submitters(struct vcam_device *vcam);
+
+/* Create the debugfs file comparing conversion with and without huge pages */
+void vcam_bench_init(void);
+
+bool vcam_is_passthrough(struct vcam_device *dev);
+
 int submitter_thread(void *data);
 
 #endif
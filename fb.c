@@ -3,21 +3,90 @@
 #include <linux/fb.h>
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
+#include <linux/topology.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "fb.h"
+#include "pool.h"
+#include "videobuf.h"
 
 struct vcamfb_info {
     struct fb_info *info;
+    /* Frame memory, NULL while nobody has the framebuffer open */
     void *addr;
     unsigned int offset;
     char name[FB_NAME_MAXLENGTH];
+    /* Releases the frame memory once the framebuffer stayed closed */
+    struct delayed_work reclaim;
 };
 
+/* Carve the input buffers out of the framebuffer memory. The first one is
+ * the memory seen through the framebuffer mapping.
+ */
+static void vcam_in_queue_init(struct vcam_in_queue *q,
+                               void *addr,
+                               size_t frame_size)
+{
+    int i;
+
+    for (i = 0; i < q->nr_buffers; i++) {
+        q->buffers[i].data = addr + i * frame_size;
+        q->buffers[i].filled = 0;
+        q->buffers[i].xbar = 0;
+        q->buffers[i].ybar = 0;
+        /* Fresh numbers, so no converted frame of the old input matches */
+        q->buffers[i].sequence = ++q->sequence;
+    }
+    memset(&q->dummy, 0, sizeof(struct vcam_in_buffer));
+    q->pending = &q->buffers[0];
+    q->ready = &q->buffers[1];
+}
+
+/* Point the framebuffer and the input queue at the frame memory @addr, or
+ * at none. Called with reconf_lock held for writing.
+ */
+static void vcamfb_set_memory(struct vcam_device *dev, void *addr)
+{
+    struct vcamfb_info *fb_data = (struct vcamfb_info *) dev->fb_priv;
+    struct fb_info *info = fb_data->info;
+
+    fb_data->addr = addr;
+    fb_data->offset = dev->input_format.sizeimage;
+    dev->mem_node = addr ? vcam_pool_node(addr) : NUMA_NO_NODE;
+    vcam_in_queue_init(&dev->in_queue, addr, addr ? fb_data->offset : 0);
+    info->fix.smem_start = (unsigned long) addr;
+    info->screen_base = (char __iomem *) addr;
+}
+
+static void vcamfb_reclaim(struct work_struct *work)
+{
+    struct vcamfb_info *fb_data =
+        container_of(to_delayed_work(work), struct vcamfb_info, reclaim);
+    struct vcam_device *dev = fb_data->info->par;
+    void *addr = NULL;
+
+    down_write(&dev->reconf_lock);
+    if (!dev->fb_isopen && fb_data->addr) {
+        addr = fb_data->addr;
+        vcamfb_set_memory(dev, NULL);
+    }
+    up_write(&dev->reconf_lock);
+
+    if (addr)
+        pr_debug("Released the frame memory of %s\n", fb_data->name);
+    vcam_pool_free(addr);
+}
+
 static int vcam_fb_open(struct fb_info *info, int user)
 {
+    struct vcamfb_info *fb_data;
+    struct v4l2_pix_format format;
     unsigned long flags = 0;
+    void *addr, *old = NULL;
+    bool alloc;
+    int node;
 
     struct vcam_device *dev = info->par;
     if (!dev) {
@@ -26,47 +95,193 @@ static int vcam_fb_open(struct fb_info *info, int user)
     }
 
     spin_lock_irqsave(&dev->in_fh_slock, flags);
-    if (dev->fb_isopen) {
+    if (dev->fb_claimed) {
         spin_unlock_irqrestore(&dev->in_fh_slock, flags);
         return -EBUSY;
     }
-    dev->fb_isopen = true;
+    dev->fb_claimed = true;
     spin_unlock_irqrestore(&dev->in_fh_slock, flags);
 
     info->par = dev;
 
+    /* Frame memory is only held while a producer may write frames. It is
+     * placed on the node of the producer unless the device is bound to one,
+     * and memory kept from a producer on another node follows this one. It
+     * is allocated before taking reconf_lock, so the submitters are not held
+     * up, and the framebuffer only shows as open once the memory is in place.
+     */
+    fb_data = dev->fb_priv;
+    cancel_delayed_work_sync(&fb_data->reclaim);
+    WRITE_ONCE(dev->producer_node, numa_node_id());
+    node = vcam_device_node(dev);
+retry:
+    down_read(&dev->reconf_lock);
+    format = dev->input_format;
+    alloc = !fb_data->addr || (dev->mem_node != node && !dev->fb_mapped);
+    up_read(&dev->reconf_lock);
+
+    addr = alloc ? vcamfb_alloc(dev, &format, node) : NULL;
+
+    down_write(&dev->reconf_lock);
+    /* The input format was switched meanwhile */
+    if (addr && format.sizeimage != dev->input_format.sizeimage) {
+        up_write(&dev->reconf_lock);
+        vcam_pool_free(addr);
+        goto retry;
+    }
+    if (addr && (!fb_data->addr || !dev->fb_mapped)) {
+        old = fb_data->addr;
+        vcamfb_set_memory(dev, addr);
+        addr = NULL;
+    }
+    spin_lock_irqsave(&dev->in_fh_slock, flags);
+    if (fb_data->addr)
+        dev->fb_isopen = true;
+    else
+        dev->fb_claimed = false;
+    spin_unlock_irqrestore(&dev->in_fh_slock, flags);
+    up_write(&dev->reconf_lock);
+
+    vcam_pool_free(addr);
+    if (!dev->fb_isopen)
+        return -ENOMEM;
+    vcam_pool_free(old);
+    vcam_place_submitters(dev);
     return 0;
 }
 
-static void swap_in_queue_buffers(struct vcam_in_queue *q)
+/* Count a write of the producer from a CPU of another node than the frame
+ * memory. Called with reconf_lock held for reading.
+ */
+static void vcam_fb_count_remote(struct vcam_device *dev)
 {
-    struct vcam_in_buffer *tmp;
-    if (!q)
-        return;
-    tmp = q->pending;
-    q->pending = q->ready;
-    q->ready = tmp;
+    if (dev->mem_node != NUMA_NO_NODE && numa_node_id() != dev->mem_node)
+        dev->remote_writes++;
+}
+
+/* Continue writing into a buffer that is neither the ready frame, being
+ * converted by a capture node nor, while the framebuffer is @mapped, the
+ * first one, which the mapping shows. The queue has one buffer per capture
+ * node plus three, so there always is one. The oldest is taken, so frames
+ * not delivered yet under the FIFO policy are overwritten last.
+ */
+static void rotate_in_queue_pending(struct vcam_in_queue *q, bool mapped)
+{
+    struct vcam_in_buffer *next = NULL;
+    int i;
+
+    for (i = mapped ? 1 : 0; i < q->nr_buffers; i++) {
+        struct vcam_in_buffer *b = &q->buffers[i];
+        if (b != q->ready && !b->readers &&
+            (!next || b->sequence < next->sequence))
+            next = b;
+    }
+    q->pending = next;
     q->pending->filled = 0;
     q->pending->xbar = 0;
     q->pending->ybar = 0;
 }
 
+/* Publish @buf as the ready frame. If it was the pending one, continue
+ * writing into another.
+ */
+static void publish_in_queue_buffer(struct vcam_in_queue *q,
+                                    struct vcam_in_buffer *buf,
+                                    bool mapped)
+{
+    q->ready = buf;
+    q->ready->sequence = ++q->sequence;
+    buf->timestamp = q->next_timestamp ? q->next_timestamp : ktime_get_ns();
+    q->next_timestamp = 0;
+    if (q->pending == buf)
+        rotate_in_queue_pending(q, mapped);
+    q->fresh = true;
+}
+
+static void swap_in_queue_buffers(struct vcam_in_queue *q, bool mapped)
+{
+    if (!q)
+        return;
+    publish_in_queue_buffer(q, q->pending, mapped);
+}
+
+/* Mark the stripe of the row about to be completed by @len bytes. With
+ * compare_writes, only if they differ from the same bytes of the previous
+ * frame @prev, which costs a read of that frame per frame written.
+ */
+static void vcam_fb_track_dirty(struct vcam_device *dev,
+                                struct vcam_in_buffer *buf,
+                                const struct vcam_in_buffer *prev,
+                                size_t len)
+{
+    const struct v4l2_pix_format *fmt = &dev->input_format;
+    size_t row = buf->filled / fmt->bytesperline;
+    unsigned int stripe;
+
+    /* A CbCr row of P010 belongs to two luma rows of the same stripe */
+    if (row >= fmt->height)
+        row = (row - fmt->height) << 1;
+    stripe = vcam_stripe_of(row);
+    if (test_bit(stripe, buf->dirty))
+        return;
+    if (!dev->write_compare_on ||
+        memcmp(buf->data + buf->filled, prev->data + buf->filled, len))
+        set_bit(stripe, buf->dirty);
+}
+
+/* In zero-copy mode, point the writer at a capture buffer for the frame
+ * being written. Called with zc_mutex held; returns NULL to fall back to
+ * the input queue.
+ *
+ * Zero copy covers write() producers of a single passthrough node only: the
+ * copy from the user buffer lands in the capture buffer. Producers drawing
+ * into the mapping keep going through the input queue. The mapping is
+ * fixed at mmap() time while capture buffers are queued and dequeued by the
+ * consumer, so sharing them with the producer would take a pool of input
+ * buffers passed by reference through a new interface.
+ */
+static void *vcam_fb_zero_copy_target(struct vcam_device *dev,
+                                      struct vcam_in_buffer *buf)
+{
+    if (dev->zc_buf && !vcam_is_passthrough(dev)) {
+        vcam_requeue_out_buffer(&dev->outputs[0], dev->zc_buf);
+        dev->zc_buf = NULL;
+    }
+
+    /* Only a frame started from the beginning can go to a capture buffer */
+    if (!dev->zc_buf && !buf->filled && !buf->xbar && !buf->ybar &&
+        vcam_is_passthrough(dev)) {
+        struct vcam_out_buffer *out = vcam_take_out_buffer(&dev->outputs[0]);
+        if (out && (!vb2_plane_vaddr(&out->vb.vb2_buf, 0) ||
+                    vb2_plane_size(&out->vb.vb2_buf, 0) <
+                        dev->input_format.sizeimage)) {
+            vcam_requeue_out_buffer(&dev->outputs[0], out);
+            out = NULL;
+        }
+        dev->zc_buf = out;
+    }
+
+    return dev->zc_buf ? vb2_plane_vaddr(&dev->zc_buf->vb.vb2_buf, 0) : NULL;
+}
+
 static ssize_t vcam_fb_write(struct fb_info *info,
                              const char __user *buffer,
                              size_t length,
                              loff_t *offset)
 {
     struct vcam_in_queue *in_q;
-    struct vcam_in_buffer *buf;
+    struct vcam_in_buffer *buf, *prev;
     size_t copy_start;
     size_t to_be_copied;
+    size_t copied = 0;
     unsigned long flags = 0;
     void *data;
     size_t bytesperpixel;
+    bool zero_copy;
 
     /* virtual resolution and min/max visible resolution's coordinates */
     size_t line_vir, line_min, line_max;
-    size_t y_vir, y_min, y_max;
+    size_t y_vir, y_min, y_max, y_total;
 
     struct vcam_device *dev = info->par;
     if (!dev) {
@@ -74,11 +289,24 @@ static ssize_t vcam_fb_write(struct fb_info *info,
         return 0;
     }
 
+    /* The input cannot be reconfigured in the middle of a write */
+    down_read(&dev->reconf_lock);
+    vcam_fb_count_remote(dev);
+
     in_q = &dev->in_queue;
 
+    /* Frames written are kept out of the buffer the mapping shows, a frame
+     * started in it before the framebuffer got mapped is dropped.
+     */
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    if (dev->fb_mapped && in_q->pending == &in_q->buffers[0])
+        rotate_in_queue_pending(in_q, true);
     buf = in_q->pending;
+    prev = in_q->ready;
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
     if (!buf) {
         pr_err("Pending pointer set to NULL\n");
+        up_read(&dev->reconf_lock);
         return 0;
     }
 
@@ -87,36 +315,56 @@ static ssize_t vcam_fb_write(struct fb_info *info,
         (((int32_t) jiffies - buf->jiffies) / HZ)) {
         pr_debug("Resetting jiffies, difference %d\n",
                  ((int32_t) jiffies - buf->jiffies));
+        vcam_stat_inc(dev->stats, VCAM_STAT_TORN);
         buf->filled = 0;
         buf->xbar = 0;
         buf->ybar = 0;
     }
     buf->jiffies = jiffies;
 
+    /* A new frame is compared with the last published one as it arrives */
+    if (!buf->filled && !buf->xbar && !buf->ybar) {
+        bitmap_zero(buf->dirty, VCAM_STRIPES_MAX);
+        buf->base_sequence = prev->sequence;
+    }
+
     /* Fill the buffer */
     copy_start = 0;
     to_be_copied = length;
 
-    data = buf->data;
+    data = NULL;
+    if (dev->zero_copy_on) {
+        mutex_lock(&dev->zc_mutex);
+        data = vcam_fb_zero_copy_target(dev, buf);
+        if (!data)
+            mutex_unlock(&dev->zc_mutex);
+    }
+    zero_copy = data != NULL;
+    if (!zero_copy)
+        data = buf->data;
     if (!data) {
         pr_err("NULL pointer to framebuffer");
+        up_read(&dev->reconf_lock);
         return 0;
     }
 
-    if (dev->input_format.pixelformat == V4L2_PIX_FMT_RGB24) {
-        bytesperpixel = 3;
-    } else if (dev->input_format.pixelformat == V4L2_PIX_FMT_YUYV) {
-        bytesperpixel = 2;
-    }
+    bytesperpixel = dev->input_format.bytesperline / dev->input_format.width;
     line_vir = info->var.xres_virtual * bytesperpixel;
     line_min = info->var.xoffset * bytesperpixel;
     line_max = (info->var.xoffset + info->var.xres) * bytesperpixel;
     y_vir = info->var.yres_virtual;
     y_min = info->var.yoffset;
     y_max = (info->var.yoffset + info->var.yres);
-
-    while (to_be_copied > 0 && buf->ybar < y_vir) {
-        if (buf->ybar < y_min || buf->ybar >= y_max || buf->xbar >= line_max) {
+    /* P010 carries a half-height CbCr plane after the luma rows */
+    y_total = y_vir;
+    if (dev->input_format.pixelformat == V4L2_PIX_FMT_P010)
+        y_total += DIV_ROUND_UP(y_vir, 2);
+
+    while (to_be_copied > 0 && buf->ybar < y_total) {
+        /* Chroma rows are cropped like the luma rows they belong to */
+        size_t y_crop =
+            buf->ybar < y_vir ? buf->ybar : (buf->ybar - y_vir) << 1;
+        if (y_crop < y_min || y_crop >= y_max || buf->xbar >= line_max) {
             size_t remain = line_vir - buf->xbar;
             if (remain > to_be_copied) {
                 buf->xbar += to_be_copied;
@@ -140,8 +388,11 @@ static ssize_t vcam_fb_write(struct fb_info *info,
                                    copyline) != 0) {
                     pr_warn("Failed to copy_from_user!");
                 }
+                if (!zero_copy)
+                    vcam_fb_track_dirty(dev, buf, prev, copyline);
                 copy_start += copyline;
                 to_be_copied -= copyline;
+                copied += copyline;
                 buf->filled += copyline;
                 buf->xbar += copyline;
                 /* After data is copied, check if buf->xbar reaches the
@@ -157,11 +408,38 @@ static ssize_t vcam_fb_write(struct fb_info *info,
     /* Check if buf->ybar reaches the border, which means the per-frame
      * information is complete. Swap the double buffer.
      */
-    if (buf->ybar == y_vir) {
+    if (buf->ybar == y_total) {
+        struct vcam_out_buffer *stale;
+
         spin_lock_irqsave(&dev->in_q_slock, flags);
-        swap_in_queue_buffers(in_q);
+        /* A newer frame supersedes one not delivered yet */
+        stale = dev->zc_ready;
+        dev->zc_ready = NULL;
+        if (zero_copy) {
+            dev->zc_ready = dev->zc_buf;
+            dev->zc_ready->input_sequence = ++in_q->sequence;
+            dev->zc_ready->input_timestamp =
+                in_q->next_timestamp ? in_q->next_timestamp : ktime_get_ns();
+            in_q->next_timestamp = 0;
+            dev->zc_buf = NULL;
+            dev->zc_active = true;
+            in_q->fresh = false;
+            buf->filled = 0;
+            buf->xbar = 0;
+            buf->ybar = 0;
+        } else {
+            swap_in_queue_buffers(in_q, dev->fb_mapped);
+            vcam_stat_inc(dev->stats, VCAM_STAT_SWAPPED);
+        }
         spin_unlock_irqrestore(&dev->in_q_slock, flags);
+        vcam_stat_inc(dev->stats, VCAM_STAT_WRITTEN);
+        if (stale)
+            vcam_requeue_out_buffer(&dev->outputs[0], stale);
     }
+    if (zero_copy)
+        mutex_unlock(&dev->zc_mutex);
+    up_read(&dev->reconf_lock);
+    vcam_stat_add(dev->stats, VCAM_STAT_INPUT_BYTES, copied);
 
     return length;
 }
@@ -171,16 +449,118 @@ static int vcam_fb_release(struct fb_info *info, int user)
 {
     unsigned long flags = 0;
     struct vcam_device *dev = info->par;
+    struct vcam_out_buffer *stale;
 
     spin_lock_irqsave(&dev->in_fh_slock, flags);
     dev->fb_isopen = false;
+    dev->fb_claimed = false;
     spin_unlock_irqrestore(&dev->in_fh_slock, flags);
+    /* The last reference is gone, so is any mapping */
+    dev->fb_mapped = false;
+    dev->fb_damage = false;
+
+    /* Drop the frames written in place, they are not shown without input */
+    mutex_lock(&dev->zc_mutex);
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    stale = dev->zc_ready;
+    dev->zc_ready = NULL;
+    dev->zc_active = false;
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
+    if (stale)
+        vcam_requeue_out_buffer(&dev->outputs[0], stale);
+    if (dev->zc_buf)
+        vcam_requeue_out_buffer(&dev->outputs[0], dev->zc_buf);
+    dev->zc_buf = NULL;
+    mutex_unlock(&dev->zc_mutex);
+
+    down_read(&dev->reconf_lock);
     dev->in_queue.pending->filled = 0;
     dev->in_queue.pending->xbar = 0;
     dev->in_queue.pending->ybar = 0;
+    up_read(&dev->reconf_lock);
+
+    if (dev->idle_release_ms)
+        schedule_delayed_work(
+            &((struct vcamfb_info *) dev->fb_priv)->reclaim,
+            msecs_to_jiffies(dev->idle_release_ms));
     return 0;
 }
 
+/* Publish the frame drawn through the framebuffer mapping, which is the
+ * first input buffer. Only the reported rows are converted again when the
+ * previous report published the same buffer.
+ */
+static void vcam_fb_publish_damage(struct vcam_device *dev,
+                                   const struct vcam_fb_damage *damage)
+{
+    struct vcam_in_queue *q = &dev->in_queue;
+    struct vcam_in_buffer *mapped = &q->buffers[0];
+    size_t height = dev->input_format.height;
+    size_t y = 0, y_end = height;
+    unsigned long flags = 0;
+
+    if (damage->height) {
+        y = min_t(size_t, damage->y, height);
+        y_end = min_t(size_t, (size_t) damage->y + damage->height, height);
+    }
+
+    spin_lock_irqsave(&dev->in_q_slock, flags);
+    mapped->base_sequence = mapped->sequence;
+    if (q->ready == mapped && dev->fb_damage) {
+        bitmap_zero(mapped->dirty, VCAM_STRIPES_MAX);
+        if (y < y_end)
+            bitmap_set(mapped->dirty, vcam_stripe_of(y),
+                       vcam_stripe_of(y_end - 1) - vcam_stripe_of(y) + 1);
+    } else {
+        /* Drawing before the first report is unaccounted for */
+        bitmap_fill(mapped->dirty, VCAM_STRIPES_MAX);
+    }
+    mapped->filled = dev->input_format.sizeimage;
+    if (q->pending == mapped)
+        vcam_stat_inc(dev->stats, VCAM_STAT_SWAPPED);
+    publish_in_queue_buffer(q, mapped, true);
+    vcam_stat_inc(dev->stats, VCAM_STAT_WRITTEN);
+    dev->fb_damage = true;
+    spin_unlock_irqrestore(&dev->in_q_slock, flags);
+}
+
+static int vcam_fb_ioctl(struct fb_info *info,
+                         unsigned int cmd,
+                         unsigned long arg)
+{
+    struct vcam_device *dev = info->par;
+    struct vcam_fb_damage damage;
+    unsigned long flags = 0;
+    __u64 timestamp;
+
+    switch (cmd) {
+    case VCAMFB_IOCTL_DAMAGE:
+        if (copy_from_user(&damage, (void __user *) arg, sizeof(damage)))
+            return -EFAULT;
+        down_read(&dev->reconf_lock);
+        /* Without a mapping the first buffer may hold a frame being
+         * written
+         */
+        if (!dev->fb_mapped) {
+            up_read(&dev->reconf_lock);
+            return -EINVAL;
+        }
+        vcam_fb_count_remote(dev);
+        vcam_fb_publish_damage(dev, &damage);
+        up_read(&dev->reconf_lock);
+        return 0;
+    case VCAMFB_IOCTL_TIMESTAMP:
+        if (copy_from_user(&timestamp, (void __user *) arg, sizeof(timestamp)))
+            return -EFAULT;
+        spin_lock_irqsave(&dev->in_q_slock, flags);
+        dev->in_queue.next_timestamp = timestamp;
+        spin_unlock_irqrestore(&dev->in_q_slock, flags);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
 static int vcam_fb_check_var(struct fb_var_screeninfo *var,
                              struct fb_info *info)
 {
@@ -267,15 +647,21 @@ static int vcam_fb_set_par(struct fb_info *info)
 
 static int vcam_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
 {
-    int ret =
-        remap_vmalloc_range(vma, (void *) info->fix.smem_start, vma->vm_pgoff);
-    if (ret < 0)
-        return -EINVAL;
-    ret = remap_vmalloc_range(
-        vma, (void *) info->fix.smem_start + info->fix.smem_len, vma->vm_pgoff);
-    if (ret < 0)
-        return -EINVAL;
-    return 0;
+    struct vcam_device *dev = info->par;
+    int ret;
+
+    /* A mapping cannot follow the memory to a new input format, so mapping
+     * waits for no reconfiguration. Waiting here under mmap_lock could
+     * deadlock against a writer faulting in its source pages.
+     */
+    if (!down_read_trylock(&dev->reconf_lock))
+        return -EAGAIN;
+    /* The mapping shows the first input buffer */
+    ret = vcam_pool_mmap(vma, (void *) info->fix.smem_start, vma->vm_pgoff);
+    if (!ret)
+        dev->fb_mapped = true;
+    up_read(&dev->reconf_lock);
+    return ret < 0 ? -EINVAL : 0;
 }
 
 static int vcam_fb_setcolreg(u_int regno,
@@ -312,9 +698,10 @@ static struct fb_ops vcamfb_ops = {
     .fb_check_var = vcam_fb_check_var,
     .fb_setcolreg = vcam_fb_setcolreg,
     .fb_mmap = vcam_fb_mmap,
+    .fb_ioctl = vcam_fb_ioctl,
 };
 
-static struct fb_fix_screeninfo vfb_fix = {
+static const struct fb_fix_screeninfo vfb_fix = {
     .id = "vcamfb",
     .type = FB_TYPE_PACKED_PIXELS,
     .visual = FB_VISUAL_TRUECOLOR,
@@ -324,7 +711,7 @@ static struct fb_fix_screeninfo vfb_fix = {
     .accel = FB_ACCEL_NONE,
 };
 
-static struct fb_var_screeninfo vfb_default = {
+static const struct fb_var_screeninfo vfb_default = {
     .pixclock = 0,
     .left_margin = 0,
     .right_margin = 0,
@@ -356,9 +743,7 @@ void set_crop_resolution(__u32 *width,
 int vcamfb_init(struct vcam_device *dev)
 {
     struct vcamfb_info *fb_data;
-    struct vcam_in_queue *q = &dev->in_queue;
     struct fb_info *info;
-    unsigned int size;
     int ret;
 
     /* malloc vcamfb_info */
@@ -366,43 +751,34 @@ int vcamfb_init(struct vcam_device *dev)
     dev->fb_priv = (void *) fb_data;
 
     /* malloc fb_info */
-    fb_data->info = framebuffer_alloc(0, &dev->vdev.dev);
+    fb_data->info = framebuffer_alloc(0, &dev->outputs[0].vdev.dev);
     info = fb_data->info;
 
-    /* malloc framebuffer and init framebuffer */
-    size = dev->input_format.sizeimage * 2;
-    if (!(fb_data->addr = vmalloc(size)))
-        return -ENOMEM;
+    /* The frame memory is allocated when the framebuffer is first opened */
+    fb_data->addr = NULL;
     fb_data->offset = dev->input_format.sizeimage;
-    q->buffers[0].data = fb_data->addr;
-    q->buffers[0].filled = 0;
-    q->buffers[0].xbar = 0;
-    q->buffers[0].ybar = 0;
-    q->buffers[1].data = (void *) (fb_data->addr + fb_data->offset);
-    q->buffers[1].filled = 0;
-    q->buffers[1].xbar = 0;
-    q->buffers[1].ybar = 0;
-    memset(&q->dummy, 0, sizeof(struct vcam_in_buffer));
-    q->pending = &q->buffers[0];
-    q->ready = &q->buffers[1];
+    vcam_in_queue_init(&dev->in_queue, NULL, 0);
+    INIT_DELAYED_WORK(&fb_data->reclaim, vcamfb_reclaim);
 
-    /* set the fb_fix */
-    vfb_fix.smem_len = dev->input_format.sizeimage;
-    vfb_fix.smem_start = (unsigned long) fb_data->addr;
-    vfb_fix.line_length = dev->input_format.bytesperline;
+    /* set the fb_fix, devices are created in parallel so the template is
+     * only read
+     */
+    info->fix = vfb_fix;
+    info->fix.smem_len = dev->input_format.sizeimage;
+    info->fix.smem_start = 0;
+    info->fix.line_length = dev->input_format.bytesperline;
 
     /* set the fb_var */
-    vfb_default.xres = dev->fb_spec.width;
-    vfb_default.yres = dev->fb_spec.height;
-    vfb_default.bits_per_pixel = 24;
-    vfb_default.xres_virtual = dev->fb_spec.xres_virtual;
-    vfb_default.yres_virtual = dev->fb_spec.yres_virtual;
-    vcam_fb_check_var(&vfb_default, info);
+    info->var = vfb_default;
+    info->var.xres = dev->config.spec.width;
+    info->var.yres = dev->config.spec.height;
+    info->var.bits_per_pixel = 24;
+    info->var.xres_virtual = dev->config.spec.xres_virtual;
+    info->var.yres_virtual = dev->config.spec.yres_virtual;
+    vcam_fb_check_var(&info->var, info);
 
     /* set the fb_info */
-    info->screen_base = (char __iomem *) fb_data->addr;
-    info->fix = vfb_fix;
-    info->var = vfb_default;
+    info->screen_base = NULL;
     info->fbops = &vcamfb_ops;
     info->par = dev;
     info->pseudo_palette = NULL;
@@ -442,6 +818,7 @@ void vcamfb_destroy(struct vcam_device *dev)
     if (!fb_data)
         return;
 
+    cancel_delayed_work_sync(&fb_data->reclaim);
     info = fb_data->info;
     if (info) {
         unregister_framebuffer(info);
@@ -449,49 +826,55 @@ void vcamfb_destroy(struct vcam_device *dev)
         framebuffer_release(info);
     }
 
-    vfree(fb_data->addr);
+    vcam_pool_free(fb_data->addr);
     vfree(fb_data);
 }
 
-void vcamfb_update(struct vcam_device *dev)
+/* Allocate the framebuffer memory for the input format @fmt on the NUMA
+ * node @node, next to the memory of the current one. The frames start black
+ * until written.
+ */
+void *vcamfb_alloc(struct vcam_device *dev,
+                   const struct v4l2_pix_format *fmt,
+                   int node)
+{
+    return vcam_pool_zalloc(fmt->sizeimage * dev->in_queue.nr_buffers, node);
+}
+
+/* Switch the framebuffer and the input queue to the memory @addr allocated
+ * for the new input format, returning the memory to free. A framebuffer
+ * holding no frame memory stays without, and @addr is returned instead. A
+ * frame partly written is dropped. Called with reconf_lock held for writing.
+ */
+void *vcamfb_update(struct vcam_device *dev, void *addr)
 {
     struct vcamfb_info *fb_data = (struct vcamfb_info *) dev->fb_priv;
     struct fb_info *info = fb_data->info;
     struct vcam_in_queue *q = &dev->in_queue;
+    void *old = addr;
 
-    /* remalloc the framebuffer and vcam_in_queue */
-    if (info->fix.smem_len != dev->input_format.sizeimage) {
-        unsigned int size;
-        vfree(fb_data->addr);
-        fb_data->offset = dev->input_format.sizeimage;
-        size = dev->input_format.sizeimage * 2;
-        fb_data->addr = vmalloc(size);
-        q->buffers[0].data = fb_data->addr;
-        q->buffers[1].data = (void *) (fb_data->addr + fb_data->offset);
-        q->buffers[0].filled = 0;
-        q->buffers[0].xbar = 0;
-        q->buffers[0].ybar = 0;
-        q->buffers[1].filled = 0;
-        q->buffers[1].xbar = 0;
-        q->buffers[1].ybar = 0;
-        memset(&q->dummy, 0, sizeof(struct vcam_in_buffer));
-
-        /* reset the fb_fix */
-        info->fix.smem_len = dev->input_format.sizeimage;
-        info->fix.smem_start = (unsigned long) fb_data->addr;
-        info->fix.line_length = dev->input_format.bytesperline;
-
-        /* reset the fb_info */
-        info->screen_base = (char __iomem *) fb_data->addr;
-
-        /* reset the fb_var */
-        info->var.xres = dev->fb_spec.width;
-        info->var.yres = dev->fb_spec.height;
-        info->var.xres_virtual = dev->fb_spec.xres_virtual;
-        info->var.yres_virtual = dev->fb_spec.yres_virtual;
-        info->var.xoffset = (info->var.xres_virtual - info->var.xres) >> 1;
-        info->var.yoffset = (info->var.yres_virtual - info->var.yres) >> 1;
+    if (fb_data->addr) {
+        old = fb_data->addr;
+        vcamfb_set_memory(dev, addr);
+    } else {
+        vcamfb_set_memory(dev, NULL);
     }
+    q->next_timestamp = 0;
+    q->fresh = false;
+
+    /* reset the fb_fix */
+    info->fix.smem_len = dev->input_format.sizeimage;
+    info->fix.line_length = dev->input_format.bytesperline;
+
+    /* reset the fb_var */
+    info->var.xres = dev->config.spec.width;
+    info->var.yres = dev->config.spec.height;
+    info->var.xres_virtual = dev->config.spec.xres_virtual;
+    info->var.yres_virtual = dev->config.spec.yres_virtual;
+    info->var.xoffset = (info->var.xres_virtual - info->var.xres) >> 1;
+    info->var.yoffset = (info->var.yres_virtual - info->var.yres) >> 1;
+
+    return old;
 }
 
 char *vcamfb_get_devnode(struct vcam_device *dev)
@@ -11,7 +11,11 @@ int vcamfb_init(struct vcam_device *dev);
 
 void vcamfb_destroy(struct vcam_device *dev);
 
-void vcamfb_update(struct vcam_device *dev);
+void *vcamfb_alloc(struct vcam_device *dev,
+                   const struct v4l2_pix_format *fmt,
+                   int node);
+
+void *vcamfb_update(struct vcam_device *dev, void *addr);
 
 char *vcamfb_get_devnode(struct vcam_device *dev);
 
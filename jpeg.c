@@ -0,0 +1,591 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "jpeg.h"
+
+/* Baseline sequential JPEG encoder with the fixed tables from ITU-T T.81
+ * Annex K. Frames are encoded as YCbCr 4:2:2 (one MCU covers 16x8 pixels),
+ * which is what UVC cameras commonly deliver as MJPEG.
+ */
+
+#define JPEG_CONST_BITS 13
+#define JPEG_PASS1_BITS 2
+#define JPEG_DESCALE(x, n) (((x) + (1 << ((n) -1))) >> (n))
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+static const u8 jpeg_zigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static const u8 jpeg_luma_quant[64] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+};
+
+static const u8 jpeg_chroma_quant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+static const u8 jpeg_dc_luma_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1,
+                                         1, 0, 0, 0, 0, 0, 0, 0};
+static const u8 jpeg_dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1,
+                                           1, 1, 1, 0, 0, 0, 0, 0};
+static const u8 jpeg_dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const u8 jpeg_ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3,
+                                         5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const u8 jpeg_ac_luma_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+static const u8 jpeg_ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4,
+                                           7, 5, 4, 4, 0, 1, 2, 0x77};
+static const u8 jpeg_ac_chroma_vals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+    0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+    0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+struct jpeg_huff {
+    u16 code[256];
+    u8 size[256];
+};
+
+static struct jpeg_huff huff_dc_luma, huff_ac_luma;
+static struct jpeg_huff huff_dc_chroma, huff_ac_chroma;
+
+struct jpeg_writer {
+    u8 *buf;
+    size_t size;
+    size_t pos;
+    u32 acc;
+    int nbits;
+    bool overflow;
+};
+
+struct vcam_jpeg_enc {
+    struct jpeg_writer w;
+    const u8 *src;
+    const u8 *src_chroma; /* CbCr plane of two-plane formats */
+    u32 src_fourcc;
+    u32 src_stride;
+    u32 width, height;
+    u32 ratio_w, ratio_h;
+    u8 qt[2][64];
+    /* level-shifted Y, Cb, Cr samples of the current 16x8 MCU */
+    s16 mcu[3][8][16];
+    int blk[64];
+};
+
+static void jpeg_build_huff(struct jpeg_huff *h, const u8 *bits, const u8 *vals)
+{
+    int len, i, k = 0;
+    u16 code = 0;
+
+    memset(h, 0, sizeof(*h));
+    for (len = 1; len <= 16; len++) {
+        for (i = 0; i < bits[len - 1]; i++) {
+            h->code[vals[k]] = code++;
+            h->size[vals[k]] = len;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+void vcam_jpeg_init(void)
+{
+    jpeg_build_huff(&huff_dc_luma, jpeg_dc_luma_bits, jpeg_dc_vals);
+    jpeg_build_huff(&huff_ac_luma, jpeg_ac_luma_bits, jpeg_ac_luma_vals);
+    jpeg_build_huff(&huff_dc_chroma, jpeg_dc_chroma_bits, jpeg_dc_vals);
+    jpeg_build_huff(&huff_ac_chroma, jpeg_ac_chroma_bits, jpeg_ac_chroma_vals);
+}
+
+static void jpeg_put_byte(struct jpeg_writer *w, u8 byte)
+{
+    if (w->pos < w->size)
+        w->buf[w->pos++] = byte;
+    else
+        w->overflow = true;
+}
+
+static void jpeg_put_u16(struct jpeg_writer *w, u16 val)
+{
+    jpeg_put_byte(w, val >> 8);
+    jpeg_put_byte(w, val & 0xff);
+}
+
+static void jpeg_put_bits(struct jpeg_writer *w, u32 bits, int len)
+{
+    w->acc = (w->acc << len) | (bits & ((1U << len) - 1));
+    w->nbits += len;
+    while (w->nbits >= 8) {
+        u8 byte = (w->acc >> (w->nbits - 8)) & 0xff;
+        jpeg_put_byte(w, byte);
+        /* Byte stuffing: 0xff in entropy-coded data is followed by 0x00 */
+        if (byte == 0xff)
+            jpeg_put_byte(w, 0x00);
+        w->nbits -= 8;
+    }
+}
+
+static void jpeg_flush_bits(struct jpeg_writer *w)
+{
+    /* Pad the last byte with 1-bits */
+    if (w->nbits > 0)
+        jpeg_put_bits(w, 0x7f, 8 - w->nbits);
+    w->acc = 0;
+    w->nbits = 0;
+}
+
+static void jpeg_scale_qtable(u8 *dst, const u8 *base, int quality)
+{
+    int i, scale;
+
+    quality = clamp(quality, 1, 100);
+    scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (i = 0; i < 64; i++)
+        dst[i] = clamp((base[i] * scale + 50) / 100, 1, 255);
+}
+
+static void jpeg_write_dht(struct jpeg_writer *w,
+                           u8 class_id,
+                           const u8 *bits,
+                           const u8 *vals)
+{
+    int i, count = 0;
+
+    for (i = 0; i < 16; i++)
+        count += bits[i];
+
+    jpeg_put_u16(w, 0xffc4);
+    jpeg_put_u16(w, 2 + 1 + 16 + count);
+    jpeg_put_byte(w, class_id);
+    for (i = 0; i < 16; i++)
+        jpeg_put_byte(w, bits[i]);
+    for (i = 0; i < count; i++)
+        jpeg_put_byte(w, vals[i]);
+}
+
+static void jpeg_write_headers(struct vcam_jpeg_enc *enc)
+{
+    static const u8 jfif[] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    struct jpeg_writer *w = &enc->w;
+    int i, t;
+
+    /* SOI and APP0 (JFIF) */
+    jpeg_put_u16(w, 0xffd8);
+    jpeg_put_u16(w, 0xffe0);
+    jpeg_put_u16(w, 2 + sizeof(jfif));
+    for (i = 0; i < sizeof(jfif); i++)
+        jpeg_put_byte(w, jfif[i]);
+
+    /* DQT, written in zig-zag order */
+    for (t = 0; t < 2; t++) {
+        jpeg_put_u16(w, 0xffdb);
+        jpeg_put_u16(w, 2 + 1 + 64);
+        jpeg_put_byte(w, t);
+        for (i = 0; i < 64; i++)
+            jpeg_put_byte(w, enc->qt[t][jpeg_zigzag[i]]);
+    }
+
+    /* SOF0: 8-bit precision, Y sampled 2x1, Cb and Cr 1x1 */
+    jpeg_put_u16(w, 0xffc0);
+    jpeg_put_u16(w, 2 + 6 + 3 * 3);
+    jpeg_put_byte(w, 8);
+    jpeg_put_u16(w, enc->height);
+    jpeg_put_u16(w, enc->width);
+    jpeg_put_byte(w, 3);
+    jpeg_put_byte(w, 1);
+    jpeg_put_byte(w, 0x21);
+    jpeg_put_byte(w, 0);
+    jpeg_put_byte(w, 2);
+    jpeg_put_byte(w, 0x11);
+    jpeg_put_byte(w, 1);
+    jpeg_put_byte(w, 3);
+    jpeg_put_byte(w, 0x11);
+    jpeg_put_byte(w, 1);
+
+    jpeg_write_dht(w, 0x00, jpeg_dc_luma_bits, jpeg_dc_vals);
+    jpeg_write_dht(w, 0x10, jpeg_ac_luma_bits, jpeg_ac_luma_vals);
+    jpeg_write_dht(w, 0x01, jpeg_dc_chroma_bits, jpeg_dc_vals);
+    jpeg_write_dht(w, 0x11, jpeg_ac_chroma_bits, jpeg_ac_chroma_vals);
+
+    /* SOS */
+    jpeg_put_u16(w, 0xffda);
+    jpeg_put_u16(w, 2 + 1 + 3 * 2 + 3);
+    jpeg_put_byte(w, 3);
+    jpeg_put_byte(w, 1);
+    jpeg_put_byte(w, 0x00);
+    jpeg_put_byte(w, 2);
+    jpeg_put_byte(w, 0x11);
+    jpeg_put_byte(w, 3);
+    jpeg_put_byte(w, 0x11);
+    jpeg_put_byte(w, 0);
+    jpeg_put_byte(w, 63);
+    jpeg_put_byte(w, 0);
+}
+
+/* Integer forward DCT, the "islow" algorithm of the IJG library. The
+ * output is scaled up by a factor of 8 compared to a true DCT.
+ */
+static void jpeg_fdct(int *data)
+{
+    int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int tmp10, tmp11, tmp12, tmp13;
+    int z1, z2, z3, z4, z5;
+    int *p;
+    int i;
+
+    for (i = 0, p = data; i < 8; i++, p += 8) {
+        tmp0 = p[0] + p[7];
+        tmp7 = p[0] - p[7];
+        tmp1 = p[1] + p[6];
+        tmp6 = p[1] - p[6];
+        tmp2 = p[2] + p[5];
+        tmp5 = p[2] - p[5];
+        tmp3 = p[3] + p[4];
+        tmp4 = p[3] - p[4];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        p[0] = (tmp10 + tmp11) << JPEG_PASS1_BITS;
+        p[4] = (tmp10 - tmp11) << JPEG_PASS1_BITS;
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        p[2] = JPEG_DESCALE(z1 + tmp13 * FIX_0_765366865,
+                            JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        p[6] = JPEG_DESCALE(z1 - tmp12 * FIX_1_847759065,
+                            JPEG_CONST_BITS - JPEG_PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+        z3 += z5;
+        z4 += z5;
+
+        p[7] = JPEG_DESCALE(tmp4 + z1 + z3, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        p[5] = JPEG_DESCALE(tmp5 + z2 + z4, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        p[3] = JPEG_DESCALE(tmp6 + z2 + z3, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        p[1] = JPEG_DESCALE(tmp7 + z1 + z4, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+    }
+
+    for (i = 0, p = data; i < 8; i++, p++) {
+        tmp0 = p[0] + p[56];
+        tmp7 = p[0] - p[56];
+        tmp1 = p[8] + p[48];
+        tmp6 = p[8] - p[48];
+        tmp2 = p[16] + p[40];
+        tmp5 = p[16] - p[40];
+        tmp3 = p[24] + p[32];
+        tmp4 = p[24] - p[32];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        p[0] = JPEG_DESCALE(tmp10 + tmp11, JPEG_PASS1_BITS);
+        p[32] = JPEG_DESCALE(tmp10 - tmp11, JPEG_PASS1_BITS);
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        p[16] = JPEG_DESCALE(z1 + tmp13 * FIX_0_765366865,
+                             JPEG_CONST_BITS + JPEG_PASS1_BITS);
+        p[48] = JPEG_DESCALE(z1 - tmp12 * FIX_1_847759065,
+                             JPEG_CONST_BITS + JPEG_PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+        z3 += z5;
+        z4 += z5;
+
+        p[56] =
+            JPEG_DESCALE(tmp4 + z1 + z3, JPEG_CONST_BITS + JPEG_PASS1_BITS);
+        p[40] =
+            JPEG_DESCALE(tmp5 + z2 + z4, JPEG_CONST_BITS + JPEG_PASS1_BITS);
+        p[24] =
+            JPEG_DESCALE(tmp6 + z2 + z3, JPEG_CONST_BITS + JPEG_PASS1_BITS);
+        p[8] = JPEG_DESCALE(tmp7 + z1 + z4, JPEG_CONST_BITS + JPEG_PASS1_BITS);
+    }
+}
+
+static void jpeg_put_value(struct jpeg_writer *w,
+                           const struct jpeg_huff *h,
+                           int symbol_hi,
+                           int val)
+{
+    int mag = val < 0 ? -val : val;
+    int size = fls(mag);
+    int symbol = symbol_hi | size;
+
+    jpeg_put_bits(w, h->code[symbol], h->size[symbol]);
+    if (size)
+        jpeg_put_bits(w, val < 0 ? val - 1 : val, size);
+}
+
+static void jpeg_encode_block(struct vcam_jpeg_enc *enc,
+                              const u8 *qt,
+                              int *prev_dc,
+                              const struct jpeg_huff *dc,
+                              const struct jpeg_huff *ac)
+{
+    int *blk = enc->blk;
+    int i, run = 0;
+
+    jpeg_fdct(blk);
+
+    /* Quantize with rounding; the DCT output carries an extra factor 8 */
+    for (i = 0; i < 64; i++) {
+        int div = qt[i] << 3;
+        int v = blk[i];
+        blk[i] = v < 0 ? -((-v + (div >> 1)) / div) : (v + (div >> 1)) / div;
+    }
+
+    jpeg_put_value(&enc->w, dc, 0, blk[0] - *prev_dc);
+    *prev_dc = blk[0];
+
+    for (i = 1; i < 64; i++) {
+        int v = blk[jpeg_zigzag[i]];
+        if (!v) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            /* ZRL: a run of 16 zeros */
+            jpeg_put_bits(&enc->w, ac->code[0xf0], ac->size[0xf0]);
+            run -= 16;
+        }
+        jpeg_put_value(&enc->w, ac, run << 4, v);
+        run = 0;
+    }
+    /* EOB */
+    if (run)
+        jpeg_put_bits(&enc->w, ac->code[0x00], ac->size[0x00]);
+}
+
+/* Gather the level-shifted full-range YCbCr samples of the 16x8 MCU at
+ * (mx, my), replicating the edge pixels past the image border.
+ */
+static void jpeg_load_mcu(struct vcam_jpeg_enc *enc, u32 mx, u32 my)
+{
+    int i, j;
+
+    for (i = 0; i < 8; i++) {
+        u32 y = min(my + i, enc->height - 1);
+        u32 sy = (y * enc->ratio_h) >> 16;
+        const u8 *row = enc->src + sy * enc->src_stride;
+
+        for (j = 0; j < 16; j++) {
+            u32 x = min(mx + j, enc->width - 1);
+            u32 sx = (x * enc->ratio_w) >> 16;
+            int luma, cb, cr;
+
+            if (enc->src_fourcc != V4L2_PIX_FMT_RGB24) {
+                int ly, lu = 128, lv = 128;
+
+                if (enc->src_fourcc == V4L2_PIX_FMT_YUYV) {
+                    const u8 *p = row + ((sx & ~1) << 1);
+                    ly = p[(sx & 1) << 1];
+                    lu = p[1];
+                    lv = p[3];
+                } else if (enc->src_fourcc == V4L2_PIX_FMT_P010) {
+                    const u16 *uv = (const u16 *) (enc->src_chroma +
+                                                   (sy >> 1) *
+                                                       enc->src_stride) +
+                                    (sx & ~1);
+                    ly = ((const u16 *) row)[sx] >> 8;
+                    lu = uv[0] >> 8;
+                    lv = uv[1] >> 8;
+                } else {
+                    /* Y10 */
+                    ly = ((const u16 *) row)[sx] >> 2;
+                }
+                /* Expand the limited range to the JFIF range */
+                luma = ((ly - 16) * 298 + 128) >> 8;
+                cb = (((lu - 128) * 291 + 128) >> 8) + 128;
+                cr = (((lv - 128) * 291 + 128) >> 8) + 128;
+            } else {
+                const u8 *p = row + sx * 3;
+                luma = (19595 * p[0] + 38470 * p[1] + 7471 * p[2] + 32768) >>
+                       16;
+                cb = ((-11059 * p[0] - 21709 * p[1] + 32768 * p[2] + 32768) >>
+                      16) +
+                     128;
+                cr = ((32768 * p[0] - 27439 * p[1] - 5329 * p[2] + 32768) >>
+                      16) +
+                     128;
+            }
+            enc->mcu[0][i][j] = clamp(luma, 0, 255) - 128;
+            enc->mcu[1][i][j] = clamp(cb, 0, 255) - 128;
+            enc->mcu[2][i][j] = clamp(cr, 0, 255) - 128;
+        }
+    }
+}
+
+struct vcam_jpeg_enc *vcam_jpeg_create(void)
+{
+    return kmalloc(sizeof(struct vcam_jpeg_enc), GFP_KERNEL);
+}
+
+void vcam_jpeg_destroy(struct vcam_jpeg_enc *enc)
+{
+    kfree(enc);
+}
+
+static size_t jpeg_encode(struct vcam_jpeg_enc *enc,
+                          void *dst,
+                          size_t dst_size,
+                          const void *src,
+                          const struct v4l2_pix_format *in,
+                          const struct v4l2_pix_format *out,
+                          int quality)
+{
+    int dc[3] = {0, 0, 0};
+    u32 mx, my;
+    int c, i, j;
+
+    enc->w.buf = dst;
+    enc->w.size = dst_size;
+    enc->w.pos = 0;
+    enc->w.acc = 0;
+    enc->w.nbits = 0;
+    enc->w.overflow = false;
+    enc->src = src;
+    enc->src_chroma = enc->src + in->bytesperline * in->height;
+    enc->src_fourcc = in->pixelformat;
+    enc->src_stride = in->bytesperline;
+    enc->width = out->width;
+    enc->height = out->height;
+    enc->ratio_w = ((in->width << 16) / out->width) + 1;
+    enc->ratio_h = ((in->height << 16) / out->height) + 1;
+    jpeg_scale_qtable(enc->qt[0], jpeg_luma_quant, quality);
+    jpeg_scale_qtable(enc->qt[1], jpeg_chroma_quant, quality);
+
+    jpeg_write_headers(enc);
+
+    for (my = 0; my < enc->height && !enc->w.overflow; my += 8) {
+        for (mx = 0; mx < enc->width; mx += 16) {
+            jpeg_load_mcu(enc, mx, my);
+
+            /* Two luma blocks side by side */
+            for (c = 0; c < 2; c++) {
+                for (i = 0; i < 8; i++)
+                    for (j = 0; j < 8; j++)
+                        enc->blk[i * 8 + j] = enc->mcu[0][i][c * 8 + j];
+                jpeg_encode_block(enc, enc->qt[0], &dc[0], &huff_dc_luma,
+                                  &huff_ac_luma);
+            }
+
+            /* Horizontally subsampled chroma */
+            for (c = 1; c < 3; c++) {
+                for (i = 0; i < 8; i++)
+                    for (j = 0; j < 8; j++)
+                        enc->blk[i * 8 + j] = (enc->mcu[c][i][j * 2] +
+                                               enc->mcu[c][i][j * 2 + 1]) >>
+                                              1;
+                jpeg_encode_block(enc, enc->qt[1], &dc[c], &huff_dc_chroma,
+                                  &huff_ac_chroma);
+            }
+        }
+    }
+
+    jpeg_flush_bits(&enc->w);
+    jpeg_put_u16(&enc->w, 0xffd9);
+
+    return enc->w.overflow ? 0 : enc->w.pos;
+}
+
+size_t vcam_jpeg_encode(struct vcam_jpeg_enc *enc,
+                        void *dst,
+                        size_t dst_size,
+                        const void *src,
+                        const struct v4l2_pix_format *in,
+                        const struct v4l2_pix_format *out,
+                        int quality)
+{
+    size_t size;
+
+    /* Noise at a high quality can take more than the buffer holds. An
+     * encoding stops at the first MCU row past the end, so each attempt
+     * costs at most one frame.
+     */
+    for (;;) {
+        size = jpeg_encode(enc, dst, dst_size, src, in, out, quality);
+        if (size || quality <= 1)
+            return size;
+        quality >>= 1;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef VCAM_JPEG_H
+#define VCAM_JPEG_H
+
+#include <linux/videodev2.h>
+
+#define VCAM_JPEG_QUALITY_DEFAULT 75
+/* Bytes of the markers and tables of an image, apart from its entropy-coded
+ * data
+ */
+#define VCAM_JPEG_HEADERS_SIZE 640
+
+struct vcam_jpeg_enc;
+
+void vcam_jpeg_init(void);
+
+struct vcam_jpeg_enc *vcam_jpeg_create(void);
+void vcam_jpeg_destroy(struct vcam_jpeg_enc *enc);
+
+/* Encode the source frame described by @in as a baseline YCbCr 4:2:2 JPEG
+ * of @out->width x @out->height, scaling with nearest neighbour if the
+ * resolutions differ. A frame that does not fit into @dst_size bytes at
+ * @quality is encoded again at halved qualities. Returns the number of bytes
+ * written to @dst, or 0 if the image does not fit even at quality 1.
+ */
+size_t vcam_jpeg_encode(struct vcam_jpeg_enc *enc,
+                        void *dst,
+                        size_t dst_size,
+                        const void *src,
+                        const struct v4l2_pix_format *in,
+                        const struct v4l2_pix_format *out,
+                        int quality);
+
+#endif
@@ -1,8 +1,12 @@
+#include <linux/debugfs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
 #include "control.h"
+#include "device.h"
+#include "jpeg.h"
+#include "pool.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("National Cheng Kung University, Taiwan");
@@ -16,6 +20,13 @@ unsigned short create_devices = 1;
 unsigned char allow_pix_conversion = 0;
 unsigned char allow_scaling = 0;
 unsigned char allow_cropping = 0;
+unsigned char allow_zero_copy = 0;
+unsigned char allow_vfr = 0;
+unsigned char compare_writes = 0;
+unsigned int preconvert_lead_us = 0;
+unsigned int idle_release_ms = 10000;
+unsigned int pool_budget_mb = 0;
+unsigned char allow_huge_pages = 0;
 
 module_param(devices_max, ushort, 0);
 MODULE_PARM_DESC(devices_max, "Maximal number of devices\n");
@@ -34,25 +45,71 @@ MODULE_PARM_DESC(allow_scaling, "Allow image scaling by default\n");
 module_param(allow_cropping, byte, 0);
 MODULE_PARM_DESC(allow_cropping, "Allow image cropping by default\n");
 
+module_param(allow_zero_copy, byte, 0);
+MODULE_PARM_DESC(allow_zero_copy,
+                 "Write frames directly into capture buffers when no "
+                 "conversion is needed\n");
+
+module_param(allow_vfr, byte, 0);
+MODULE_PARM_DESC(allow_vfr,
+                 "Deliver frames only when the input changes, at most at the "
+                 "output frame rate\n");
+
+module_param(compare_writes, byte, 0);
+MODULE_PARM_DESC(compare_writes,
+                 "Compare frames written to the framebuffer with the previous "
+                 "one, so only the stripes that changed are converted again\n");
+
+module_param(preconvert_lead_us, uint, 0);
+MODULE_PARM_DESC(preconvert_lead_us,
+                 "Convert each frame this many microseconds before it is due, "
+                 "0 to convert it when due\n");
+
+module_param(idle_release_ms, uint, 0);
+MODULE_PARM_DESC(idle_release_ms,
+                 "Release the frame memory of a device this many milliseconds "
+                 "after its framebuffer is closed, 0 to keep it\n");
+
+module_param(pool_budget_mb, uint, 0);
+MODULE_PARM_DESC(pool_budget_mb,
+                 "Frame memory all devices may use together in MiB, 0 for no "
+                 "limit\n");
+
+module_param(allow_huge_pages, byte, 0);
+MODULE_PARM_DESC(allow_huge_pages,
+                 "Back frame memory of 2 MiB or more with huge pages\n");
+
 const char *vcam_dev_name = VCAM_DEV_NAME;
+struct dentry *vcam_debugfs_root;
 
 static int __init vcam_init(void)
 {
-    int i;
-    int ret = create_control_device(CONTROL_DEV_NAME);
+    int ret;
+
+    vcam_jpeg_init();
+    vcam_debugfs_root = debugfs_create_dir(VCAM_DEV_NAME, NULL);
+    vcam_bench_init();
+
+    ret = create_control_device(CONTROL_DEV_NAME);
     if (ret)
         goto failure;
 
-    for (i = 0; i < create_devices; i++)
-        request_vcam_device(NULL);
+    if (create_devices)
+        request_vcam_devices(NULL, create_devices, NULL);
+
+    return 0;
 
 failure:
+    debugfs_remove_recursive(vcam_debugfs_root);
+    vcam_pool_exit();
     return ret;
 }
 
 static void __exit vcam_exit(void)
 {
     destroy_control_device();
+    debugfs_remove_recursive(vcam_debugfs_root);
+    vcam_pool_exit();
 }
 
 module_init(vcam_init);
@@ -0,0 +1,243 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/numa.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+
+#include "pool.h"
+
+extern unsigned int pool_budget_mb;
+extern unsigned char allow_huge_pages;
+
+struct vcam_pool_block {
+    struct list_head list;
+    void *addr;
+    size_t size;
+    /* NUMA node the pages were taken from, NUMA_NO_NODE for any */
+    int node;
+    /* Mapped with 2 MiB pages where the allocator found them */
+    bool huge;
+};
+
+static DEFINE_MUTEX(pool_lock);
+/* Blocks freed, the most recently freed first */
+static LIST_HEAD(pool_cached);
+/* Blocks in use, by the page frame of their address */
+static DEFINE_XARRAY(pool_blocks);
+static size_t pool_used;
+static size_t pool_cached_bytes;
+static u64 pool_failures;
+
+/* Whether blocks of @size bytes are backed by huge pages. Frames are read
+ * row by row at strides of a row or more while they are scaled, which with
+ * 4 KiB pages costs a TLB miss every few rows. vmalloc_huge() cannot be told
+ * a node, and reading across nodes costs more than the TLB misses, so blocks
+ * bound to a node keep small pages.
+ */
+static bool vcam_pool_huge(size_t size, int node)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    return allow_huge_pages && size >= PMD_SIZE && node == NUMA_NO_NODE;
+#else
+    return false;
+#endif
+}
+
+/* Round @size up to a quarter of its power of two, and at least a page, so
+ * blocks waste less than a quarter of their size and frames of similar
+ * formats share a class. Huge blocks are whole huge pages.
+ */
+static size_t vcam_pool_class(size_t size, int node)
+{
+    size_t granule;
+
+    if (vcam_pool_huge(size, node))
+        return ALIGN(size, PMD_SIZE);
+    granule = max_t(size_t, PAGE_SIZE, roundup_pow_of_two(size) >> 2);
+    return ALIGN(size, granule);
+}
+
+static unsigned long vcam_pool_key(const void *addr)
+{
+    return (unsigned long) addr >> PAGE_SHIFT;
+}
+
+static void vcam_pool_release(struct vcam_pool_block *block)
+{
+    list_del(&block->list);
+    pool_cached_bytes -= block->size;
+    vfree(block->addr);
+    kfree(block);
+}
+
+static void *vcam_pool_get(size_t size, int node, bool zero)
+{
+    size_t budget = (size_t) pool_budget_mb << 20;
+    struct vcam_pool_block *block = NULL, *b;
+
+    if (!size)
+        return NULL;
+    size = vcam_pool_class(size, node);
+
+    mutex_lock(&pool_lock);
+    list_for_each_entry(b, &pool_cached, list) {
+        if (b->size == size && b->node == node) {
+            block = b;
+            break;
+        }
+    }
+    if (block) {
+        list_del(&block->list);
+        pool_cached_bytes -= size;
+        if (zero)
+            memset(block->addr, 0, size);
+    } else {
+        /* Give cached blocks of other classes back to stay in budget */
+        while (budget && pool_used + pool_cached_bytes + size > budget &&
+               !list_empty(&pool_cached))
+            vcam_pool_release(list_last_entry(
+                &pool_cached, struct vcam_pool_block, list));
+        if (budget && pool_used + size > budget)
+            goto failure;
+
+        block = kmalloc(sizeof(*block), GFP_KERNEL);
+        if (!block)
+            goto failure;
+        /* Zeroed, and mappable through the framebuffer */
+        block->node = node;
+        block->huge = vcam_pool_huge(size, node);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+        if (block->huge)
+            block->addr = vmalloc_huge(size, GFP_KERNEL | __GFP_ZERO);
+        else
+#endif
+        if (node != NUMA_NO_NODE)
+            block->addr = vzalloc_node(size, node);
+        else
+            block->addr = vmalloc_user(size);
+        if (!block->addr) {
+            kfree(block);
+            goto failure;
+        }
+        block->size = size;
+    }
+
+    if (xa_err(xa_store(&pool_blocks, vcam_pool_key(block->addr), block,
+                        GFP_KERNEL))) {
+        list_add(&block->list, &pool_cached);
+        pool_cached_bytes += size;
+        goto failure;
+    }
+    pool_used += size;
+    mutex_unlock(&pool_lock);
+    return block->addr;
+
+failure:
+    pool_failures++;
+    mutex_unlock(&pool_lock);
+    pr_debug("Failed to allocate %zu bytes of frame memory\n", size);
+    return NULL;
+}
+
+void *vcam_pool_alloc(size_t size, int node)
+{
+    return vcam_pool_get(size, node, false);
+}
+
+void *vcam_pool_zalloc(size_t size, int node)
+{
+    return vcam_pool_get(size, node, true);
+}
+
+void vcam_pool_free(void *addr)
+{
+    struct vcam_pool_block *block;
+
+    if (!addr)
+        return;
+
+    mutex_lock(&pool_lock);
+    block = xa_erase(&pool_blocks, vcam_pool_key(addr));
+    if (!block) {
+        mutex_unlock(&pool_lock);
+        pr_err("Freeing frame memory not from the pool\n");
+        return;
+    }
+    pool_used -= block->size;
+    list_add(&block->list, &pool_cached);
+    pool_cached_bytes += block->size;
+    while (pool_cached_bytes > VCAM_POOL_CACHE_MAX)
+        vcam_pool_release(
+            list_last_entry(&pool_cached, struct vcam_pool_block, list));
+    mutex_unlock(&pool_lock);
+}
+
+int vcam_pool_node(void *addr)
+{
+    struct vcam_pool_block *block;
+    int node = NUMA_NO_NODE;
+
+    mutex_lock(&pool_lock);
+    block = xa_load(&pool_blocks, vcam_pool_key(addr));
+    if (block)
+        node = block->node;
+    mutex_unlock(&pool_lock);
+    return node;
+}
+
+int vcam_pool_mmap(struct vm_area_struct *vma,
+                   void *addr,
+                   unsigned long pgoff)
+{
+    struct vcam_pool_block *block;
+    unsigned long uaddr;
+    int ret = 0;
+
+    mutex_lock(&pool_lock);
+    block = xa_load(&pool_blocks, vcam_pool_key(addr));
+    mutex_unlock(&pool_lock);
+    if (!block)
+        return -EINVAL;
+    if (!block->huge && block->node == NUMA_NO_NODE)
+        return remap_vmalloc_range(vma, addr, pgoff);
+
+    /* remap_vmalloc_range() only takes areas allocated for user space, which
+     * neither vmalloc_huge() nor vzalloc_node() allocate. The huge pages of
+     * vmalloc_huge() are split, so the pages are inserted one at a time like
+     * it does.
+     */
+    if ((pgoff << PAGE_SHIFT) + (vma->vm_end - vma->vm_start) > block->size)
+        return -EINVAL;
+    addr += pgoff << PAGE_SHIFT;
+    for (uaddr = vma->vm_start; uaddr < vma->vm_end && !ret;
+         uaddr += PAGE_SIZE, addr += PAGE_SIZE)
+        ret = vm_insert_page(vma, uaddr, vmalloc_to_page(addr));
+    return ret;
+}
+
+void vcam_pool_get_stats(struct vcam_pool_stats *stats)
+{
+    mutex_lock(&pool_lock);
+    stats->used = pool_used;
+    stats->cached = pool_cached_bytes;
+    stats->budget = (size_t) pool_budget_mb << 20;
+    stats->failures = pool_failures;
+    mutex_unlock(&pool_lock);
+}
+
+void vcam_pool_exit(void)
+{
+    while (!list_empty(&pool_cached))
+        vcam_pool_release(
+            list_first_entry(&pool_cached, struct vcam_pool_block, list));
+    if (pool_used)
+        pr_err("%zu bytes of frame memory still in use\n", pool_used);
+    xa_destroy(&pool_blocks);
+}
@@ -0,0 +1,40 @@
+#ifndef VCAM_POOL_H
+#define VCAM_POOL_H
+
+#include <linux/mm.h>
+#include <linux/types.h>
+
+/* Frame memory freed is kept for reuse up to this size */
+#define VCAM_POOL_CACHE_MAX (32 << 20)
+
+struct vcam_pool_stats {
+    size_t used;
+    size_t cached;
+    size_t budget;
+    u64 failures;
+};
+
+void vcam_pool_exit(void);
+
+/* Allocate frame memory for input queues, test patterns and conversion
+ * buffers, from the NUMA node @node or from any for NUMA_NO_NODE. Blocks are
+ * rounded up to a size class and reused once freed, so devices created,
+ * reconfigured and destroyed often do not churn vmalloc space. Returns NULL
+ * when the pool budget would be exceeded. The memory is mapped to user space
+ * with vcam_pool_mmap().
+ */
+void *vcam_pool_alloc(size_t size, int node);
+void *vcam_pool_zalloc(size_t size, int node);
+void vcam_pool_free(void *addr);
+
+/* The NUMA node the block allocated at @addr is on, NUMA_NO_NODE for any */
+int vcam_pool_node(void *addr);
+
+/* Map the block allocated at @addr into @vma from its page @pgoff on */
+int vcam_pool_mmap(struct vm_area_struct *vma,
+                   void *addr,
+                   unsigned long pgoff);
+
+void vcam_pool_get_stats(struct vcam_pool_stats *stats);
+
+#endif
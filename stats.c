@@ -0,0 +1,87 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "device.h"
+#include "stats.h"
+
+static const char *const vcam_stat_names[VCAM_STAT_MAX] = {
+    [VCAM_STAT_WRITTEN] = "written",     [VCAM_STAT_SWAPPED] = "swapped",
+    [VCAM_STAT_DELIVERED] = "delivered", [VCAM_STAT_REPEATED] = "repeated",
+    [VCAM_STAT_DROPPED] = "dropped",     [VCAM_STAT_TORN] = "torn",
+    [VCAM_STAT_EMPTY] = "empty",
+    [VCAM_STAT_INPUT_BYTES] = "input_bytes",
+    [VCAM_STAT_OUTPUT_BYTES] = "output_bytes",
+};
+
+static const char *const vcam_hist_names[VCAM_HIST_MAX] = {
+    [VCAM_HIST_CONVERSION] = "conversion_ns",
+    [VCAM_HIST_LATENESS] = "lateness_ns",
+    [VCAM_HIST_LATENCY] = "latency_ns",
+};
+
+/* Sum the counters of all CPUs. A counter being added to meanwhile is read
+ * before or after, which is as good for monitoring.
+ */
+static void vcam_stats_sum(struct vcam_device *vcam, struct vcam_stats *sum)
+{
+    int cpu, i, j;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        struct vcam_stats *stats = per_cpu_ptr(vcam->stats, cpu);
+
+        for (i = 0; i < VCAM_STAT_MAX; i++)
+            sum->count[i] += READ_ONCE(stats->count[i]);
+        for (i = 0; i < VCAM_HIST_MAX; i++)
+            for (j = 0; j < VCAM_HIST_BUCKETS; j++)
+                sum->hist[i][j] += READ_ONCE(stats->hist[i][j]);
+    }
+}
+
+/* One "name: value" line per counter, then each histogram with a line per
+ * bucket holding any sample: its lower bound in ns and its count.
+ */
+static int vcam_stats_show(struct seq_file *s, void *unused)
+{
+    struct vcam_stats *sum;
+    int i, j;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+    vcam_stats_sum(s->private, sum);
+
+    for (i = 0; i < VCAM_STAT_MAX; i++)
+        seq_printf(s, "%s: %llu\n", vcam_stat_names[i], sum->count[i]);
+    for (i = 0; i < VCAM_HIST_MAX; i++) {
+        seq_printf(s, "%s:\n", vcam_hist_names[i]);
+        for (j = 0; j < VCAM_HIST_BUCKETS; j++) {
+            if (sum->hist[i][j])
+                seq_printf(s, "  %llu: %llu\n", j ? 1ULL << j : 0ULL,
+                           sum->hist[i][j]);
+        }
+    }
+    kfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vcam_stats);
+
+int vcam_stats_init(struct vcam_device *vcam)
+{
+    vcam->stats = alloc_percpu(struct vcam_stats);
+    if (!vcam->stats)
+        return -ENOMEM;
+    debugfs_create_file("stats", 0444, vcam->debugfs, vcam, &vcam_stats_fops);
+    return 0;
+}
+
+void vcam_stats_destroy(struct vcam_device *vcam)
+{
+    free_percpu(vcam->stats);
+    vcam->stats = NULL;
+}
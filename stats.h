@@ -0,0 +1,86 @@
+#ifndef VCAM_STATS_H
+#define VCAM_STATS_H
+
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+struct vcam_device;
+
+enum vcam_stat {
+    /* Frames completed by the producer, with write() or a damage report */
+    VCAM_STAT_WRITTEN,
+    /* Frames the input queue switched to a new pending buffer for */
+    VCAM_STAT_SWAPPED,
+    /* Capture buffers delivered, and those showing the same picture as the
+     * one before: the same input frame, or a still test pattern
+     */
+    VCAM_STAT_DELIVERED,
+    VCAM_STAT_REPEATED,
+    /* Frames due that missed their deadline */
+    VCAM_STAT_DROPPED,
+    /* Partial frames dropped after the producer stalled for a second */
+    VCAM_STAT_TORN,
+    /* Frames due without a capture buffer queued */
+    VCAM_STAT_EMPTY,
+    /* Bytes written by producers with write() */
+    VCAM_STAT_INPUT_BYTES,
+    /* Bytes of payload in the capture buffers delivered */
+    VCAM_STAT_OUTPUT_BYTES,
+    VCAM_STAT_MAX,
+};
+
+enum vcam_hist {
+    /* Time to convert an input frame into a capture buffer */
+    VCAM_HIST_CONVERSION,
+    /* How late a submitter woke up for a deadline */
+    VCAM_HIST_LATENESS,
+    /* From the time of an input frame to the delivery of a buffer with it */
+    VCAM_HIST_LATENCY,
+    VCAM_HIST_MAX,
+};
+
+/* Bucket i counts durations from 2^i ns up to 2^(i+1) ns, the first one
+ * also those under a ns and the last one all above.
+ */
+#define VCAM_HIST_BUCKETS 32
+
+/* Counters of a device on one CPU. They are only ever added to from the CPU
+ * they belong to, so updating them takes no lock and no atomic operation.
+ */
+struct vcam_stats {
+    u64 count[VCAM_STAT_MAX];
+    u64 hist[VCAM_HIST_MAX][VCAM_HIST_BUCKETS];
+};
+
+/* Allocate the counters of @vcam and expose their sums in its debugfs
+ * directory as "stats".
+ */
+int vcam_stats_init(struct vcam_device *vcam);
+void vcam_stats_destroy(struct vcam_device *vcam);
+
+static inline void vcam_stat_add(struct vcam_stats __percpu *stats,
+                                 enum vcam_stat stat,
+                                 u64 value)
+{
+    this_cpu_add(stats->count[stat], value);
+}
+
+static inline void vcam_stat_inc(struct vcam_stats __percpu *stats,
+                                 enum vcam_stat stat)
+{
+    this_cpu_inc(stats->count[stat]);
+}
+
+static inline void vcam_hist_record(struct vcam_stats __percpu *stats,
+                                    enum vcam_hist hist,
+                                    u64 ns)
+{
+    unsigned int bucket = ns ? ilog2(ns) : 0;
+
+    bucket = min_t(unsigned int, bucket, VCAM_HIST_BUCKETS - 1);
+    this_cpu_inc(stats->hist[hist][bucket]);
+}
+
+#endif
@@ -1,3 +1,5 @@
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
@@ -10,14 +12,17 @@
 
 #include "vcam.h"
 
-static const char *short_options = "hcm:r:ls:p:d:t:";
+static const char *short_options = "hcm:r:ls:p:d:t:o:n:N:C:S:";
 
 const struct option long_options[] = {
     {"help", 0, NULL, 'h'},    {"create", 0, NULL, 'c'},
     {"modify", 1, NULL, 'm'},  {"list", 0, NULL, 'l'},
     {"size", 1, NULL, 's'},    {"pixfmt", 1, NULL, 'p'},
     {"device", 1, NULL, 'd'},  {"remove", 1, NULL, 'r'},
-    {"memtype", 1, NULL, 't'}, {NULL, 0, NULL, 0}};
+    {"memtype", 1, NULL, 't'}, {"outputs", 1, NULL, 'o'},
+    {"number", 1, NULL, 'n'},  {"node", 1, NULL, 'N'},
+    {"cpus", 1, NULL, 'C'},    {"sched", 1, NULL, 'S'},
+    {NULL, 0, NULL, 0}};
 
 const char *help =
     " -h --help                            Print this informations.\n"
@@ -36,8 +41,19 @@ const char *help =
     "                 WxHxCR: 640x480x5/6  Specify the virtual resolution "
     "and apply with crop ratio.\n"
     "\n"
-    " -p --pixfmt  pix_fmt                 Specify pixel format (rgb24,yuyv).\n"
-    " -t --memtype mem_type                Specify memory type (mmap,dmabuf).\n"
+    " -p --pixfmt  pix_fmt                 Specify pixel format (rgb24,yuyv,y10,p010).\n"
+    " -t --memtype mem_type                Specify memory type (mmap,dmabuf,dmabuf-sg).\n"
+    " -o --outputs count                   Number of capture nodes fed by "
+    "the framebuffer (1-4).\n"
+    " -n --number  count                   Number of devices to create at "
+    "once.\n"
+    " -N --node    node                    NUMA node of the frame memory and "
+    "capture threads.\n"
+    " -C --cpus    list                    CPUs of the capture threads "
+    "(0,2-3).\n"
+    " -S --sched   policy[:value]          Scheduling of the capture threads "
+    "(normal,\n"
+    "                                      fifo:priority,deadline:runtime_us).\n"
     " -d --device  /dev/*                  Control device node.\n";
 
 enum ACTION { ACTION_NONE, ACTION_CREATE, ACTION_DESTROY, ACTION_MODIFY };
@@ -101,19 +117,92 @@ int determine_pixfmt(char *pixfmt_str)
         return VCAM_PIXFMT_RGB24;
     if (!strncmp(pixfmt_str, "yuyv", 4))
         return VCAM_PIXFMT_YUYV;
+    if (!strncmp(pixfmt_str, "y10", 3))
+        return VCAM_PIXFMT_Y10;
+    if (!strncmp(pixfmt_str, "p010", 4))
+        return VCAM_PIXFMT_P010;
     return -1;
 }
 
+const char *pixfmt_name(int pix_fmt)
+{
+    switch (pix_fmt) {
+    case VCAM_PIXFMT_YUYV:
+        return "yuyv";
+    case VCAM_PIXFMT_Y10:
+        return "y10";
+    case VCAM_PIXFMT_P010:
+        return "p010";
+    default:
+        return "rgb24";
+    }
+}
+
+const char *memtype_name(int mem_type)
+{
+    switch (mem_type) {
+    case VCAM_MEMORY_DMABUF:
+        return "dmabuf";
+    case VCAM_MEMORY_DMABUF_SG:
+        return "dmabuf-sg";
+    default:
+        return "mmap";
+    }
+}
+
+const char *sched_name(int sched_policy)
+{
+    switch (sched_policy) {
+    case VCAM_SCHED_FIFO:
+        return "fifo";
+    case VCAM_SCHED_DEADLINE:
+        return "deadline";
+    default:
+        return "normal";
+    }
+}
+
+/* Parse policy[:value], the value being the priority of fifo and the
+ * runtime in microseconds of deadline.
+ */
+bool parse_sched(char *sched_str, struct vcam_device_config *dev)
+{
+    char *value = strchr(sched_str, ':');
+
+    if (value)
+        *value++ = '\0';
+    if (!strcmp(sched_str, "normal") && !value) {
+        dev->sched_policy = VCAM_SCHED_NORMAL;
+        return true;
+    }
+    if (!strcmp(sched_str, "fifo")) {
+        dev->sched_policy = VCAM_SCHED_FIFO;
+        dev->sched_priority = value ? atoi(value) : 0;
+        return !value ||
+               (dev->sched_priority >= 1 && dev->sched_priority <= 99);
+    }
+    if (!strcmp(sched_str, "deadline")) {
+        dev->sched_policy = VCAM_SCHED_DEADLINE;
+        dev->sched_runtime_us = value ? atoi(value) : 0;
+        return !value || dev->sched_runtime_us > 0;
+    }
+    return false;
+}
+
 int determine_memtype(char *memtype_str)
 {
     if (!strncmp(memtype_str, "mmap", 4))
         return VCAM_MEMORY_MMAP;
+    if (!strncmp(memtype_str, "dmabuf-sg", 9))
+        return VCAM_MEMORY_DMABUF_SG;
     if (!strncmp(memtype_str, "dmabuf", 6))
         return VCAM_MEMORY_DMABUF;
     return -1;
 }
-int create_device(struct vcam_device_spec *dev)
+int create_device(struct vcam_device_config *config, unsigned int count)
 {
+    struct vcam_device_spec *dev = &config->spec;
+
     int fd = open(ctl_path, O_RDWR);
     if (fd == -1) {
         fprintf(stderr, "Failed to open %s device.\n", ctl_path);
@@ -131,11 +220,47 @@ int create_device(struct vcam_device_spec *dev)
     if (!dev->mem_type)
         dev->mem_type = device_template.mem_type;
 
-    int res = ioctl(fd, VCAM_IOCTL_CREATE_DEVICE, dev);
+    if (count <= 1) {
+        int res = ioctl(fd, VCAM_IOCTL_CREATE_CONFIG, config);
+        if (res) {
+            fprintf(stderr, "Failed to create a new device: %s.\n",
+                    strerror(errno));
+        }
+
+        close(fd);
+        return res;
+    }
+
+    /* Several identical devices are created with a single call */
+    struct vcam_device_config *specs = calloc(count, sizeof(*specs));
+    __s32 *results = calloc(count, sizeof(*results));
+    struct vcam_device_create create = {
+        .count = count,
+        .spec_size = sizeof(*specs),
+        .specs = (__u64) (unsigned long) specs,
+        .results = (__u64) (unsigned long) results,
+    };
+    int res = -1;
+    unsigned int i;
+
+    if (specs && results) {
+        for (i = 0; i < count; i++)
+            specs[i] = *config;
+        res = ioctl(fd, VCAM_IOCTL_CREATE_DEVICES, &create);
+    }
     if (res) {
-        fprintf(stderr, "Failed to create a new device.\n");
+        fprintf(stderr, "Failed to create new devices.\n");
+    } else {
+        for (i = 0; i < count; i++)
+            if (results[i])
+                fprintf(stderr, "Failed to create device %u of %u: %s.\n",
+                        i + 1, count, strerror(-results[i]));
+        if (create.created < count)
+            res = -1;
     }
 
+    free(results);
+    free(specs);
     close(fd);
     return res;
 }
@@ -158,9 +283,11 @@ int remove_device(struct vcam_device_spec *dev)
     return res;
 }
 
-int modify_device(struct vcam_device_spec *dev)
+int modify_device(struct vcam_device_config *config)
 {
-    struct vcam_device_spec orig_dev = {.idx = dev->idx};
+    struct vcam_device_config orig = {.spec.idx = config->spec.idx};
+    struct vcam_device_spec *dev = &config->spec;
+    struct vcam_device_spec *orig_dev = &orig.spec;
 
     int fd = open(ctl_path, O_RDWR);
     if (fd == -1) {
@@ -168,30 +295,43 @@ int modify_device(struct vcam_device_spec *dev)
         return -1;
     }
 
-    if (ioctl(fd, VCAM_IOCTL_GET_DEVICE, &orig_dev)) {
+    if (ioctl(fd, VCAM_IOCTL_GET_CONFIG, &orig)) {
         fprintf(stderr, "Failed to find device on index %d.\n",
-                orig_dev.idx + 1);
+                orig_dev->idx + 1);
         close(fd);
         return -1;
     }
 
     if (!dev->width || !dev->height) {
-        dev->width = orig_dev.width;
-        dev->height = orig_dev.height;
+        dev->width = orig_dev->width;
+        dev->height = orig_dev->height;
     }
 
     if (!dev->pix_fmt)
-        dev->pix_fmt = orig_dev.pix_fmt;
+        dev->pix_fmt = orig_dev->pix_fmt;
 
     if (!dev->mem_type)
-        dev->mem_type = orig_dev.mem_type;
+        dev->mem_type = orig_dev->mem_type;
 
     if (!dev->cropratio.numerator || !dev->cropratio.denominator)
-        dev->cropratio = orig_dev.cropratio;
+        dev->cropratio = orig_dev->cropratio;
+
+    if (!config->numa_node)
+        config->numa_node = orig.numa_node;
 
-    int res = ioctl(fd, VCAM_IOCTL_MODIFY_SETTING, dev);
+    if (!config->cpus[0])
+        memcpy(config->cpus, orig.cpus, sizeof(config->cpus));
+
+    if (!config->sched_policy) {
+        config->sched_policy = orig.sched_policy;
+        config->sched_priority = orig.sched_priority;
+        config->sched_runtime_us = orig.sched_runtime_us;
+    }
+
+    int res = ioctl(fd, VCAM_IOCTL_MODIFY_CONFIG, config);
     if (res) {
-        fprintf(stderr, "Failed to modify the device.\n");
+        fprintf(stderr, "Failed to modify the device: %s.\n",
+                strerror(errno));
     }
 
     close(fd);
@@ -200,7 +340,12 @@ int modify_device(struct vcam_device_spec *dev)
 
 int list_devices()
 {
-    struct vcam_device_spec dev = {.idx = 0};
+    struct vcam_device_enum devenum = {
+        .count = 8,
+        .state_size = sizeof(struct vcam_device_state),
+    };
+    struct vcam_device_state *states = NULL;
+    unsigned int i, j;
 
     int fd = open(ctl_path, O_RDWR);
     if (fd == -1) {
@@ -208,16 +353,58 @@ int list_devices()
         return -1;
     }
 
+    /* Fetch all devices at once, growing the array if it was too small */
+    do {
+        if (devenum.total > devenum.count)
+            devenum.count = devenum.total;
+        free(states);
+        states = calloc(devenum.count, sizeof(*states));
+        if (!states) {
+            close(fd);
+            return -1;
+        }
+        devenum.devices = (__u64) (unsigned long) states;
+        if (ioctl(fd, VCAM_IOCTL_ENUM_DEVICES, &devenum)) {
+            fprintf(stderr, "Failed to enumerate devices.\n");
+            free(states);
+            close(fd);
+            return -1;
+        }
+    } while (devenum.total > devenum.count);
+
     printf("Available virtual V4L2 compatible devices:\n");
-    while (!ioctl(fd, VCAM_IOCTL_GET_DEVICE, &dev)) {
-        dev.idx++;
-        printf("%d. %s(%d,%d,%d/%d,%s,%s) -> %s\n", dev.idx, dev.fb_node,
-               dev.width, dev.height, dev.cropratio.numerator,
-               dev.cropratio.denominator,
-               dev.pix_fmt == VCAM_PIXFMT_RGB24 ? "rgb24" : "yuyv",
-               dev.mem_type == VCAM_MEMORY_MMAP ? "mmap" : "dmabuf",
-               dev.video_node);
+    for (i = 0; i < devenum.count; i++) {
+        struct vcam_device_config *config = &states[i].config;
+        struct vcam_device_spec *dev = &config->spec;
+        unsigned int nr_outputs = config->nr_outputs ? config->nr_outputs : 1;
+
+        printf("%d. %s(%d,%d,%d/%d,%s,%s) -> %s", dev->idx + 1,
+               dev->fb_node, dev->width, dev->height,
+               dev->cropratio.numerator, dev->cropratio.denominator,
+               pixfmt_name(dev->pix_fmt), memtype_name(dev->mem_type),
+               dev->video_node);
+        if (config->numa_node)
+            printf(" [node %u]", config->numa_node - 1);
+        if (config->cpus[0])
+            printf(" [cpus %s]", config->cpus);
+        if (config->sched_policy == VCAM_SCHED_FIFO)
+            printf(" [fifo %u]", config->sched_priority);
+        else if (config->sched_policy == VCAM_SCHED_DEADLINE)
+            printf(" [deadline]");
+        printf("%s\n", states[i].fb_open ? " [input open]" : "");
+        for (j = 0; j < nr_outputs && j < VCAM_OUTPUTS_MAX; j++) {
+            struct vcam_output_state *out = &states[i].outputs[j];
+
+            if (!out->streaming)
+                continue;
+            printf("   output %u: streaming, %u frames, %u.%03u fps, "
+                   "%llu skipped, %llu dropped\n",
+                   j, out->sequence, out->fps / 1000, out->fps % 1000,
+                   (unsigned long long) out->skipped,
+                   (unsigned long long) out->dropped);
+        }
     }
+    free(states);
     close(fd);
     return 0;
 }
@@ -226,11 +413,13 @@ int main(int argc, char *argv[])
 {
     int next_option;
     enum ACTION current_action = ACTION_NONE;
-    struct vcam_device_spec dev;
+    struct vcam_device_config config;
+    struct vcam_device_spec *dev = &config.spec;
+    unsigned int count = 1;
     int ret = 0;
     int tmp;
 
-    memset(&dev, 0x00, sizeof(struct vcam_device_spec));
+    memset(&config, 0x00, sizeof(config));
 
     /* Process command line options */
     do {
@@ -246,24 +435,24 @@ int main(int argc, char *argv[])
             break;
         case 'm':
             current_action = ACTION_MODIFY;
-            dev.idx = atoi(optarg) - 1;
+            dev->idx = atoi(optarg) - 1;
             break;
         case 'r':
             current_action = ACTION_DESTROY;
-            dev.idx = atoi(optarg) - 1;
+            dev->idx = atoi(optarg) - 1;
             printf("Removing the device.\n");
             break;
         case 'l':
             list_devices();
             break;
         case 's':
-            if (!parse_resolution(optarg, &dev)) {
+            if (!parse_resolution(optarg, dev)) {
                 fprintf(stderr, "Failed to parse resolution and crop ratio.\n");
                 exit(-1);
             }
-            printf("Setting resolution to %dx%dx%d/%d.\n", dev.width,
-                   dev.height, dev.cropratio.numerator,
-                   dev.cropratio.denominator);
+            printf("Setting resolution to %dx%dx%d/%d.\n", dev->width,
+                   dev->height, dev->cropratio.numerator,
+                   dev->cropratio.denominator);
             break;
         case 'p':
             tmp = determine_pixfmt(optarg);
@@ -272,7 +461,7 @@ int main(int argc, char *argv[])
                         optarg);
                 exit(-1);
             }
-            dev.pix_fmt = (char) tmp;
+            dev->pix_fmt = (char) tmp;
             printf("Setting pixel format to %s.\n", optarg);
             break;
         case 't':
@@ -282,9 +471,55 @@ int main(int argc, char *argv[])
                         optarg);
                 exit(-1);
             }
-            dev.mem_type = (char) tmp;
+            dev->mem_type = (char) tmp;
             printf("Setting memory type to %s.\n", optarg);
             break;
+        case 'o':
+            tmp = atoi(optarg);
+            if (tmp < 1 || tmp > VCAM_OUTPUTS_MAX) {
+                fprintf(stderr, "Failed to recognize output count %s.\n",
+                        optarg);
+                exit(-1);
+            }
+            config.nr_outputs = tmp;
+            printf("Setting output count to %d.\n", tmp);
+            break;
+        case 'n':
+            tmp = atoi(optarg);
+            if (tmp < 1) {
+                fprintf(stderr, "Failed to recognize device count %s.\n",
+                        optarg);
+                exit(-1);
+            }
+            count = tmp;
+            printf("Creating %d devices.\n", tmp);
+            break;
+        case 'N':
+            if (!isdigit((unsigned char) optarg[0])) {
+                fprintf(stderr, "Failed to recognize NUMA node %s.\n",
+                        optarg);
+                exit(-1);
+            }
+            tmp = atoi(optarg);
+            config.numa_node = tmp + 1;
+            printf("Setting NUMA node to %d.\n", tmp);
+            break;
+        case 'C':
+            if (strlen(optarg) >= sizeof(config.cpus)) {
+                fprintf(stderr, "Failed to recognize CPU list %s.\n", optarg);
+                exit(-1);
+            }
+            strcpy(config.cpus, optarg);
+            printf("Setting CPUs to %s.\n", optarg);
+            break;
+        case 'S':
+            if (!parse_sched(optarg, &config)) {
+                fprintf(stderr, "Failed to recognize scheduling policy.\n");
+                exit(-1);
+            }
+            printf("Setting scheduling policy to %s.\n",
+                   sched_name(config.sched_policy));
+            break;
         case 'd':
             printf("Using device %s.\n", optarg);
             strncpy(ctl_path, optarg, sizeof(ctl_path) - 1);
@@ -294,13 +529,13 @@ int main(int argc, char *argv[])
 
     switch (current_action) {
     case ACTION_CREATE:
-        ret = create_device(&dev);
+        ret = create_device(&config, count);
         break;
     case ACTION_DESTROY:
-        ret = remove_device(&dev);
+        ret = remove_device(dev);
         break;
     case ACTION_MODIFY:
-        ret = modify_device(&dev);
+        ret = modify_device(&config);
         break;
     case ACTION_NONE:
         break;
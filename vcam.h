@@ -2,21 +2,74 @@
 #define VCAM_H
 
 #include <asm/types.h>
+#include <linux/ioctl.h>
 
+/* Take a struct vcam_device_spec */
 #define VCAM_IOCTL_CREATE_DEVICE 0x111
 #define VCAM_IOCTL_DESTROY_DEVICE 0x222
 #define VCAM_IOCTL_GET_DEVICE 0x333
-#define VCAM_IOCTL_ENUM_DEVICES 0x444
 #define VCAM_IOCTL_MODIFY_SETTING 0x555
 
-typedef enum { VCAM_PIXFMT_RGB24 = 0x01, VCAM_PIXFMT_YUYV = 0x02 } pixfmt_t;
-typedef enum { VCAM_MEMORY_MMAP = 0, VCAM_MEMORY_DMABUF = 2 } memtype_t;
+/* Like the ones above with the settings of struct vcam_device_config. The
+ * numbers encode the size of their argument, so a client built against
+ * another layout is refused instead of misread.
+ */
+#define VCAM_IOCTL_CREATE_CONFIG _IOWR('v', 1, struct vcam_device_config)
+#define VCAM_IOCTL_GET_CONFIG _IOWR('v', 2, struct vcam_device_config)
+#define VCAM_IOCTL_MODIFY_CONFIG _IOWR('v', 3, struct vcam_device_config)
+#define VCAM_IOCTL_ENUM_DEVICES _IOWR('v', 4, struct vcam_device_enum)
+#define VCAM_IOCTL_CREATE_DEVICES _IOWR('v', 5, struct vcam_device_create)
+
+/* Issued on the framebuffer device by producers drawing into its mapping,
+ * fails with EINVAL while the framebuffer is not mapped
+ */
+#define VCAMFB_IOCTL_DAMAGE _IOW('v', 6, struct vcam_fb_damage)
+/* Issued on the framebuffer device with a pointer to a __u64: the
+ * CLOCK_MONOTONIC time in ns at which the next frame published was captured.
+ * Frames without one are stamped when they are complete.
+ */
+#define VCAMFB_IOCTL_TIMESTAMP _IOW('v', 7, __u64)
+
+/* The capture nodes have a read-only "Buffer Delivery Times" array control,
+ * V4L2_CID_USER_BASE | 0xf000, of VB2_MAX_FRAME __s64 elements. Element i is
+ * the CLOCK_MONOTONIC time in ns at which buffer i was last completed. Read
+ * it between the DQBUF of buffer i and its next QBUF: a queued buffer can be
+ * completed at any time, which overwrites the element.
+ */
+
+#define VCAM_OUTPUTS_MAX 4
+
+typedef enum {
+    VCAM_PIXFMT_RGB24 = 0x01,
+    VCAM_PIXFMT_YUYV = 0x02,
+    VCAM_PIXFMT_Y10 = 0x03,
+    VCAM_PIXFMT_P010 = 0x04
+} pixfmt_t;
+typedef enum {
+    VCAM_MEMORY_MMAP = 0,
+    VCAM_MEMORY_DMABUF = 2,
+    VCAM_MEMORY_DMABUF_SG = 3
+} memtype_t;
+typedef enum {
+    VCAM_SCHED_NORMAL = 0x01,
+    VCAM_SCHED_FIFO = 0x02,
+    VCAM_SCHED_DEADLINE = 0x03
+} schedpolicy_t;
 
 struct crop_ratio {
     __u32 numerator;
     __u32 denominator;
 };
 
+/* Rows [y, y + height) of the mapped framebuffer changed since the last
+ * damage report; a height of 0 marks the whole frame. The report publishes
+ * the frame to the capture nodes.
+ */
+struct vcam_fb_damage {
+    __u32 y;
+    __u32 height;
+};
+
 struct vcam_device_spec {
     unsigned int idx;
 
@@ -33,4 +86,87 @@ struct vcam_device_spec {
     char fb_node[64];
 };
 
+/* A device spec and the settings added after it. Zeroed settings take their
+ * defaults when creating a device. The devices created with
+ * VCAM_IOCTL_CREATE_DEVICE get the defaults, and VCAM_IOCTL_MODIFY_SETTING
+ * keeps the settings of the device.
+ */
+struct vcam_device_config {
+    struct vcam_device_spec spec;
+
+    /* number of capture nodes fed by the framebuffer, 0 means 1 */
+    __u32 nr_outputs;
+    /* NUMA node of the frame memory and the capture threads plus one, 0 for
+     * the node of the producer opening the framebuffer
+     */
+    __u32 numa_node;
+    /* CPUs the capture threads run on, as a list such as "0,2-3", empty for
+     * any. Threads bound to a NUMA node run on those of the node if any.
+     */
+    char cpus[64];
+    /* Scheduling of the capture threads, a schedpolicy_t. The priority
+     * applies to VCAM_SCHED_FIFO, from 1 to 99, 0 for 50. The runtime applies
+     * to VCAM_SCHED_DEADLINE, in microseconds per frame interval, 0 for a
+     * quarter of the interval.
+     */
+    __u32 sched_policy;
+    __u32 sched_priority;
+    __u32 sched_runtime_us;
+    __u32 reserved;
+};
+
+/* State of a capture node, counted since it last started streaming */
+struct vcam_output_state {
+    __u32 streaming;
+    /* frames due on the node, as in the buffer sequence */
+    __u32 sequence;
+    /* input frames passed over, frames missed and frames finished late */
+    __u64 skipped;
+    __u64 dropped;
+    __u64 overruns;
+    /* frame rate achieved over the last second, in thousandths */
+    __u32 fps;
+    __u32 reserved;
+};
+
+struct vcam_device_state {
+    struct vcam_device_config config;
+    /* a producer has the framebuffer open */
+    __u32 fb_open;
+    /* input frames published on the framebuffer */
+    __u32 input_frames;
+    struct vcam_output_state outputs[VCAM_OUTPUTS_MAX];
+};
+
+/* Argument of VCAM_IOCTL_CREATE_DEVICES. One device is created for each of
+ * the count struct vcam_device_config in the array at specs, which are
+ * updated as with VCAM_IOCTL_CREATE_CONFIG and get the index of their device.
+ * spec_size is the size of the array elements. The __s32 array at results
+ * receives 0 or a negative error code for each spec, and created is set to
+ * the number of devices created. Their video nodes and framebuffers are
+ * registered as each device is initialized, but /dev/vcamctl only lists and
+ * finds the devices once all of them are.
+ */
+struct vcam_device_create {
+    __u32 count;
+    __u32 created;
+    __u32 spec_size;
+    __u32 reserved;
+    __u64 specs;
+    __u64 results;
+};
+
+/* Argument of VCAM_IOCTL_ENUM_DEVICES. The state of up to count devices is
+ * written to the array at devices, whose elements are state_size bytes, and
+ * count is set to the number written. total is set to the number of devices
+ * present, which may be more.
+ */
+struct vcam_device_enum {
+    __u32 count;
+    __u32 total;
+    __u32 state_size;
+    __u32 reserved;
+    __u64 devices;
+};
+
 #endif
@@ -1,11 +1,14 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/kthread.h>
 #include <linux/spinlock.h>
-#include <linux/vmalloc.h>
 #include <media/videobuf2-core.h>
 #include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-dma-sg.h>
 #include <media/videobuf2-vmalloc.h>
 
+#include "jpeg.h"
+#include "pool.h"
 #include "videobuf.h"
 
 static int vcam_out_queue_setup(struct vb2_queue *vq,
@@ -15,8 +18,8 @@ static int vcam_out_queue_setup(struct vb2_queue *vq,
                                 struct device *alloc_ctxs[])
 {
     int i;
-    struct vcam_device *dev = vb2_get_drv_priv(vq);
-    unsigned long size = dev->output_format.sizeimage;
+    struct vcam_output *out = vb2_get_drv_priv(vq);
+    unsigned long size = out->output_format.sizeimage;
 
     if (*nbuffers < 2)
         *nbuffers = 2;
@@ -38,8 +41,8 @@ static int vcam_out_queue_setup(struct vb2_queue *vq,
 
 static int vcam_out_buffer_prepare(struct vb2_buffer *vb)
 {
-    struct vcam_device *dev = vb2_get_drv_priv(vb->vb2_queue);
-    unsigned long size = dev->output_format.sizeimage;
+    struct vcam_output *out = vb2_get_drv_priv(vb->vb2_queue);
+    unsigned long size = out->output_format.sizeimage;
     if (vb2_plane_size(vb, 0) < size) {
         pr_err(KERN_ERR "data will not fit into buffer\n");
         return -EINVAL;
@@ -52,67 +55,285 @@ static int vcam_out_buffer_prepare(struct vb2_buffer *vb)
 static void vcam_out_buffer_queue(struct vb2_buffer *vb)
 {
     unsigned long flags = 0;
-    struct vcam_device *dev = vb2_get_drv_priv(vb->vb2_queue);
+    struct vcam_output *out = vb2_get_drv_priv(vb->vb2_queue);
     struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
     struct vcam_out_buffer *buf =
         container_of(vbuf, struct vcam_out_buffer, vb);
-    struct vcam_out_queue *q = &dev->vcam_out_vidq;
+    struct vcam_out_queue *q = &out->vcam_out_vidq;
     buf->filled = 0;
 
-    spin_lock_irqsave(&dev->out_q_slock, flags);
+    spin_lock_irqsave(&out->out_q_slock, flags);
     list_add_tail(&buf->list, &q->active);
-    spin_unlock_irqrestore(&dev->out_q_slock, flags);
+    spin_unlock_irqrestore(&out->out_q_slock, flags);
+}
+
+static void vcam_return_all_buffers(struct vcam_output *out,
+                                    enum vb2_buffer_state state)
+{
+    struct vcam_out_queue *q = &out->vcam_out_vidq;
+    unsigned long flags = 0;
+
+    spin_lock_irqsave(&out->out_q_slock, flags);
+    while (!list_empty(&q->active)) {
+        struct vcam_out_buffer *buf =
+            list_entry(q->active.next, struct vcam_out_buffer, list);
+        list_del(&buf->list);
+        vb2_buffer_done(&buf->vb.vb2_buf, state);
+        pr_debug("Throwing out buffer\n");
+    }
+    spin_unlock_irqrestore(&out->out_q_slock, flags);
+}
+
+/* Take the oldest queued capture buffer, or NULL if there is none */
+struct vcam_out_buffer *vcam_take_out_buffer(struct vcam_output *out)
+{
+    struct vcam_out_queue *q = &out->vcam_out_vidq;
+    struct vcam_out_buffer *buf = NULL;
+    unsigned long flags = 0;
+
+    spin_lock_irqsave(&out->out_q_slock, flags);
+    if (!list_empty(&q->active)) {
+        buf = list_entry(q->active.next, struct vcam_out_buffer, list);
+        list_del(&buf->list);
+    }
+    spin_unlock_irqrestore(&out->out_q_slock, flags);
+    return buf;
+}
+
+/* Give back a buffer taken but not completed, so it is used next */
+void vcam_requeue_out_buffer(struct vcam_output *out,
+                             struct vcam_out_buffer *buf)
+{
+    unsigned long flags = 0;
+
+    spin_lock_irqsave(&out->out_q_slock, flags);
+    list_add(&buf->list, &out->vcam_out_vidq.active);
+    spin_unlock_irqrestore(&out->out_q_slock, flags);
+}
+
+static void vcam_free_jpeg(struct vcam_output *out)
+{
+    vcam_jpeg_destroy(out->jpeg_enc);
+    out->jpeg_enc = NULL;
+    vcam_pool_free(out->jpeg_scratch);
+    out->jpeg_scratch = NULL;
+}
+
+static int vcam_alloc_jpeg(struct vcam_output *out)
+{
+    /* The no-input pattern is rendered as YUYV before being compressed */
+    size_t scratch_size =
+        (out->output_format.width * out->output_format.height) << 1;
+
+    out->jpeg_enc = vcam_jpeg_create();
+    out->jpeg_scratch =
+        vcam_pool_alloc(scratch_size, vcam_device_node(out->dev));
+    if (!out->jpeg_enc || !out->jpeg_scratch) {
+        vcam_free_jpeg(out);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void vcam_free_pattern(struct vcam_output *out)
+{
+    vcam_pool_free(out->pattern.frame);
+    out->pattern.frame = NULL;
+    vcam_pool_free(out->pattern.jpeg);
+    out->pattern.jpeg = NULL;
+}
+
+static int vcam_alloc_pattern(struct vcam_output *out)
+{
+    const struct v4l2_pix_format *fmt = &out->output_format;
+    size_t size = fmt->sizeimage;
+    int node = vcam_device_node(out->dev);
+
+    out->pattern.id = -1;
+    if (fmt->pixelformat == V4L2_PIX_FMT_MJPEG) {
+        size = (fmt->width * fmt->height) << 1;
+        out->pattern.jpeg = vcam_pool_alloc(fmt->sizeimage, node);
+        if (!out->pattern.jpeg)
+            return -ENOMEM;
+    }
+    out->pattern.frame = vcam_pool_alloc(size, node);
+    if (!out->pattern.frame) {
+        vcam_free_pattern(out);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static bool vcam_same_format(const struct v4l2_pix_format *a,
+                             const struct v4l2_pix_format *b)
+{
+    return a->pixelformat == b->pixelformat && a->width == b->width &&
+           a->height == b->height;
+}
+
+/* Cache the converted frames, shared with the other streaming nodes of the
+ * same format. A node streaming the input format unchanged copies straight
+ * from the input and needs no cache. The quality of MJPEG is set per node
+ * and lowered while it is degraded, so each MJPEG node has a cache of its
+ * own instead of reencoding the frames of another.
+ */
+static int vcam_attach_cache(struct vcam_output *out)
+{
+    struct vcam_device *dev = out->dev;
+    struct vcam_conv_cache *cache = NULL;
+    int i, ret = 0;
+
+    if (vcam_same_format(&out->output_format, &dev->input_format))
+        return 0;
+
+    mutex_lock(&dev->caches_mutex);
+    for (i = 0; i < VCAM_OUTPUTS_MAX && !cache; i++) {
+        if (dev->caches[i].users &&
+            out->output_format.pixelformat != V4L2_PIX_FMT_MJPEG &&
+            vcam_same_format(&dev->caches[i].format, &out->output_format))
+            cache = &dev->caches[i];
+    }
+    for (i = 0; i < VCAM_OUTPUTS_MAX && !cache; i++) {
+        if (!dev->caches[i].users) {
+            cache = &dev->caches[i];
+            cache->format = out->output_format;
+            cache->valid = false;
+            cache->data = vcam_pool_alloc(cache->format.sizeimage,
+                                          vcam_device_node(dev));
+            if (!cache->data)
+                ret = -ENOMEM;
+        }
+    }
+    if (!ret) {
+        cache->users++;
+        out->cache = cache;
+    }
+    mutex_unlock(&dev->caches_mutex);
+    return ret;
+}
+
+static void vcam_detach_cache(struct vcam_output *out)
+{
+    struct vcam_device *dev = out->dev;
+    struct vcam_conv_cache *cache = out->cache;
+
+    if (!cache)
+        return;
+
+    mutex_lock(&dev->caches_mutex);
+    if (!--cache->users) {
+        vcam_pool_free(cache->data);
+        cache->data = NULL;
+        cache->valid = false;
+    }
+    out->cache = NULL;
+    mutex_unlock(&dev->caches_mutex);
 }
 
 static int vcam_start_streaming(struct vb2_queue *q, unsigned int count)
 {
-    struct vcam_device *dev = q->drv_priv;
+    struct vcam_output *out = q->drv_priv;
+    int node, ret;
 
-    /* Try to start kernel thread */
-    dev->sub_thr_id = kthread_create(submitter_thread, dev, "vcam_submitter");
-    if (!dev->sub_thr_id) {
+    out->sequence = 0;
+    out->last_input = VCAM_INPUT_NONE;
+    out->skipped = 0;
+    out->overload.degraded = false;
+    out->overload.late = 0;
+    out->overload.on_time = 0;
+    out->fps_window_start = ktime_get_ns();
+    out->fps_frames = 0;
+    out->fps_achieved = 0;
+    out->remote_frames = 0;
+
+    if (out->output_format.pixelformat == V4L2_PIX_FMT_MJPEG &&
+        vcam_alloc_jpeg(out)) {
+        pr_err("Failed to allocate MJPEG encoder\n");
+        ret = -ENOMEM;
+        goto jpeg_failure;
+    }
+
+    ret = vcam_alloc_pattern(out);
+    if (ret) {
+        pr_err("Failed to allocate test pattern\n");
+        goto pattern_failure;
+    }
+
+    ret = vcam_attach_cache(out);
+    if (ret) {
+        pr_err("Failed to allocate conversion cache\n");
+        goto cache_failure;
+    }
+
+    /* Try to start kernel thread, next to the frame memory it converts */
+    node = vcam_device_node(out->dev);
+    out->sub_thr_id = kthread_create_on_node(submitter_thread, out, node,
+                                             "vcam-%u-out%u", out->dev->idx,
+                                             out->idx);
+    if (IS_ERR(out->sub_thr_id)) {
         pr_err("Failed to create kernel thread\n");
-        return -ECANCELED;
+        ret = PTR_ERR(out->sub_thr_id);
+        out->sub_thr_id = NULL;
+        goto thread_failure;
     }
+    vcam_place_submitter(out);
 
-    wake_up_process(dev->sub_thr_id);
+    wake_up_process(out->sub_thr_id);
 
     return 0;
+
+thread_failure:
+    vcam_detach_cache(out);
+cache_failure:
+    vcam_free_pattern(out);
+pattern_failure:
+    vcam_free_jpeg(out);
+jpeg_failure:
+    vcam_return_all_buffers(out, VB2_BUF_STATE_QUEUED);
+    return ret;
 }
 
 static void vcam_stop_streaming(struct vb2_queue *vb2_q)
 {
-    struct vcam_device *dev = vb2_q->drv_priv;
-    struct vcam_out_queue *q = &dev->vcam_out_vidq;
-    unsigned long flags = 0;
+    struct vcam_output *out = vb2_q->drv_priv;
+    struct vcam_device *dev = out->dev;
 
     /* Stop running threads */
-    if (dev->sub_thr_id)
-        kthread_stop(dev->sub_thr_id);
+    if (out->sub_thr_id)
+        kthread_stop(out->sub_thr_id);
 
-    dev->sub_thr_id = NULL;
-    /* Empty buffer queue */
-    spin_lock_irqsave(&dev->out_q_slock, flags);
-    while (!list_empty(&q->active)) {
-        struct vcam_out_buffer *buf =
-            list_entry(q->active.next, struct vcam_out_buffer, list);
-        list_del(&buf->list);
-        vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_ERROR);
-        pr_debug("Throwing out buffer\n");
-    }
-    spin_unlock_irqrestore(&dev->out_q_slock, flags);
+    out->sub_thr_id = NULL;
+    if (out->prepared)
+        vcam_requeue_out_buffer(out, out->prepared);
+    out->prepared = NULL;
+    vcam_detach_cache(out);
+    vcam_free_pattern(out);
+    vcam_free_jpeg(out);
+
+    /* Empty buffer queue, including the buffers lent to the framebuffer
+     * writer. The lock keeps the writer from taking another one meanwhile.
+     */
+    mutex_lock(&dev->zc_mutex);
+    if (dev->zc_buf)
+        vcam_requeue_out_buffer(out, dev->zc_buf);
+    if (dev->zc_ready)
+        vcam_requeue_out_buffer(out, dev->zc_ready);
+    dev->zc_buf = NULL;
+    dev->zc_ready = NULL;
+    vcam_return_all_buffers(out, VB2_BUF_STATE_ERROR);
+    mutex_unlock(&dev->zc_mutex);
 }
 
 static void vcam_outbuf_lock(struct vb2_queue *vq)
 {
-    struct vcam_device *dev = vb2_get_drv_priv(vq);
-    mutex_lock(&dev->vcam_mutex);
+    struct vcam_output *out = vb2_get_drv_priv(vq);
+    mutex_lock(&out->vcam_mutex);
 }
 
 static void vcam_outbuf_unlock(struct vb2_queue *vq)
 {
-    struct vcam_device *dev = vb2_get_drv_priv(vq);
-    mutex_unlock(&dev->vcam_mutex);
+    struct vcam_output *out = vb2_get_drv_priv(vq);
+    mutex_unlock(&out->vcam_mutex);
 }
 
 static int vcam_buf_init(struct vb2_buffer *vb)
@@ -144,31 +365,43 @@ static const struct vb2_ops vcam_vb2_ops = {
     .buf_cleanup = vcam_buf_cleanup,
 };
 
-int vcam_out_videobuf2_setup(struct vcam_device *dev)
+int vcam_out_videobuf2_setup(struct vcam_output *out)
 {
-    struct vb2_queue *q = &dev->vb_out_vidq;
+    struct vb2_queue *q = &out->vb_out_vidq;
 
     q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     q->io_modes = VB2_MMAP | VB2_USERPTR | VB2_READ | VB2_DMABUF;
-    q->drv_priv = dev;
+    q->drv_priv = out;
     q->buf_struct_size = sizeof(struct vcam_out_buffer);
-    q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    /* Buffers carry the capture time of their input frame, and their
+     * delivery time is read with VCAM_CID_DELIVERY_TIMES.
+     */
+    q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
     q->ops = &vcam_vb2_ops;
-    pr_info("memory type %d\n", dev->mem_type);
-    switch (dev->mem_type) {
+    pr_info("memory type %d\n", out->dev->mem_type);
+    switch (out->dev->mem_type) {
     case VCAM_MEMORY_MMAP:
         q->mem_ops = &vb2_vmalloc_memops;
         break;
     case VCAM_MEMORY_DMABUF:
         q->mem_ops = &vb2_dma_contig_memops;
         break;
+    case VCAM_MEMORY_DMABUF_SG:
+        /* Page-sized chunks, no physically contiguous allocation needed */
+        q->mem_ops = &vb2_dma_sg_memops;
+        break;
+    default:
+        q->mem_ops = &vb2_vmalloc_memops;
+        break;
     }
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
     q->min_queued_buffers = 2;
+    /* Every buffer index has an element in VCAM_CID_DELIVERY_TIMES */
+    q->max_num_buffers = VB2_MAX_FRAME;
 #else
     q->min_buffers_needed = 2;
 #endif
-    q->lock = &dev->vcam_mutex;
+    q->lock = &out->vcam_mutex;
 
     return vb2_queue_init(q);
 }
@@ -3,6 +3,10 @@
 
 #include "device.h"
 
-int vcam_out_videobuf2_setup(struct vcam_device *dev);
+int vcam_out_videobuf2_setup(struct vcam_output *out);
+
+struct vcam_out_buffer *vcam_take_out_buffer(struct vcam_output *out);
+void vcam_requeue_out_buffer(struct vcam_output *out,
+                             struct vcam_out_buffer *buf);
 
 #endif